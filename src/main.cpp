@@ -3,131 +3,1033 @@
    Allows user calibration of 3 modes
    Resolution +/- 2grams at 10SPS for medianCount n = 3 and pump Vf = 12V
 
-   Version 1.3
+   Version 1.28
    IMP: Update version in void.setup() after every change
+   Text shown on the LCD and printed on serial is kept in flash, either in MESSAGES[] or with F()
 
    Written By:
    Anish Krishnakumar
    28 April 2021
    Updated on 2 May 2021 to include inspect contents feature and running median
+   Updated on 17 October 2026 to include thermistor temperature compensation (A6)
+   Updated on 17 October 2026 to include multi-point load cell linearization
+   Updated on 17 October 2026 to include auto-zero tracking and creep compensation
+   Updated on 17 October 2026 to include HX711 fault detection
+   Updated on 17 October 2026 to include relay cycle counting and welded contact detection
+   Updated on 17 October 2026 to include production counters and shift statistics
+   Updated on 17 October 2026 to include black box of the last samples and watchdog during fills
+   Updated on 17 October 2026 to include compressed fill curve capture
+   Updated on 17 October 2026 to include SPC alarms and stop offset adjustment
+   Updated on 17 October 2026 to include checkweigher mode
+   Updated on 17 October 2026 to include multi-ingredient recipes
+   Updated on 17 October 2026 to include batch job queue
+   Updated on 17 October 2026 to include flow meter input fused with the scale reading
+   Updated on 17 October 2026 to include timed dosing while the scale is faulted
+   Updated on 17 October 2026 to include pump priming and hose delay learning
+   Updated on 17 October 2026 to include anti-drip valve output
+   Updated on 17 October 2026 to include sub-sample relay cut-off on Timer1
+   Updated on 17 October 2026 to include a hardware abstraction for 32-bit boards and benchmarks
+   Updated on 17 October 2026 to include low-power idle
+   Updated on 17 October 2026 to include the message table in flash and memory report
+   Updated on 17 October 2026 to include binary config snapshot export and import
+   Updated on 17 October 2026 to include noise measurement and automatic filter window
+   Updated on 17 October 2026 to include live diagnostics pages
+   Updated on 17 October 2026 to include net mass and volume metering in manual mode
+   Updated on 17 October 2026 to include teach-in of a mode from a manual fill
 
    Press and hold both buttons while switching on to enter calibration mode
+   Select 'Linearize scale' in calibration mode to record the reference masses in LIN_MASS[]
    Press and hold any one of the buttons while switching on to inspect EEPROM contents
+   Hold DISPENSE for 2 seconds on the shift page of inspect contents to start a new shift
+   The last two pages of inspect contents show live diagnostics: samples per second, standard
+   deviation, min and max of the readings over the last second, the zero offset, and the
+   average and worst loop time. Fills, the other front panel functions, serial commands and
+   sleep are left out of the loop time. DIAG prints the same from the readings of loop()
+
+   Serial commands (9600 baud, end with newline):
+     STATS        Print production counters and shift statistics
+     SHIFT RESET  Start a new shift
+     BBOX         Print the black box saved on the last fault or watchdog reset
+     BBOX LIVE    Print the black box currently in RAM
+     CURVES       Print the stored fill curves
+     CURVE NEXT   Capture the curve of the next fill
+     SPC          Print the SPC state of each mode
+     SPC <ewma limit> <cusum k> <cusum h> <auto adjust 0/1>
+                  Set the SPC limits in counts and save them
+     SPC RESET    Relearn the center line of every mode
+     JOB <mode> <count>  Queue a job and start the jobs
+     JOBS         Print the job queue
+     JOB CLEAR    Clear the job queue
+     FLOW         Print the learned counts per flow meter pulse and density of each mode
+     DOSE         Print the learned flow rate and timed dose of each mode
+     VALVE        Print the anti-drip valve timing
+     VALVE <offset ms> <auto tune 0/1>
+                  Set the time the valve closes after the pump turns off and save it
+     PREDICT <0/1>  Turn the sub-sample relay cut-off off or on and save it
+     BENCH        Time the filter and control paths in us and CPU cycles per call
+     MEM          Print static RAM, free RAM, stack high-water mark and flash used
+     NOISE        Print the measured noise and the median filter window
+     NOISE RUN    Place a container first. Measure the noise with the pump off, then running
+                  for NOISE_SAMPLES readings, and set the median filter window from it
+     DIAG         Print the live diagnostics
+     TEACH <mode> Save the last manual fill as mode 1 to 3
+     FILTER <n>   Set the median filter window (odd, 1 to MEDIAN_MAX) and save it
+     CONFIG EXPORT  Send the configuration as a binary snapshot
+     CONFIG IMPORT  Reply 'Config ready', then receive a binary snapshot within CONFIG_TIMEOUT
+                  and apply it. If an import is interrupted the machine does not fill until
+                  a snapshot is imported again
+                  Use tools/config_snapshot.py to export, import and diff snapshots
 
    Press MODE button to select mode. Each mode is associated with a certain volume
    which can be changed in VOLUME[] array
 
    Press DISPENSE button to start dispensing
 
+   In manual mode the pump runs while DISPENSE is held. The scale is tared at the press and the
+   net mass and volume (at MANUAL_DENSITY) are shown while filling. On release the drips are
+   allowed to settle and the net amount, drip and settle time are logged on serial
+
+   Teach-in: fill one container carefully in manual mode, then press MODE within TEACH_WAIT ms of
+   the result being shown. Choose the mode with MODE and press DISPENSE to save the fill as that
+   mode. The settled net mass becomes the threshold, the drip the initial stop offset and the
+   volume at MANUAL_DENSITY replaces VOLUME[] of the mode. The SPC, flow meter and timed dose
+   of the mode are learned again
+
+   Press MODE until 'Checkweigh' and press DISPENSE to check pre-filled bottles against the
+   volume of a mode. Tolerance of each mode is set in TOLERANCE[]
+
+   Press MODE until 'Recipe' and press DISPENSE to dispense a recipe. Each ingredient has its
+   own pump on PUMP_PINS[] and is dispensed in turn against a fresh tare. Recipes are set in
+   RECIPE_VOLUME[], RECIPE_DENSITY[] and RECIPE_PARTS[]. Press DISPENSE to abort
+
+   Press MODE until 'Batch jobs' and press DISPENSE to queue jobs of a number of bottles per mode.
+   While jobs run, each bottle placed on the empty platform is filled without pressing DISPENSE
+   and the next job starts when one is complete. Press MODE to pause the jobs. Paused jobs are
+   resumed from 'Batch jobs' with DISPENSE, or MODE adds another job first
+
+   Press MODE until 'Prime pump', place a waste container and press DISPENSE to prime the hose
+   after an idle period or a product change. Once the hose is full the pump is stopped and run
+   once more, and the time from pump on to the first rise of the mass is learned as the hose
+   delay. Liquid keeps arriving for that long after the relay turns off, so the relay is turned
+   off that much earlier at the flow rate of the fill. The SPC auto adjust takes up any shift
+   this causes in the fill results
+   Priming also measures the scale noise with the pump off and, over the purge, with it
+   running, and sets the median filter window of fills to the smallest that brings the noise
+   below NOISE_TARGET. NOISE RUN does the same without priming
+
+   An optional pinch valve or suck-back solenoid on VALVE_PIN opens with the pump and closes
+   valveOffset ms after it. With auto tune on, the mass dripping after the valve closes on
+   an automatic fill moves the close earlier when above VALVE_DRIP and later when below half of it
+
+   With PREDICT 1 the rise between the last two medians of a fill is extrapolated to the time
+   the stop point will be crossed. If that is before the next median, Timer1 turns the relay off
+   at that time instead of after the next median. Timer1 must not be used for anything else
+
+   After IDLE_MINUTES without a button press, fill, serial command or load change the HX711 is
+   powered down, the display blanked and the MCU put to sleep. Press any button or send a newline
+   on serial to wake it. The press or character that wakes the machine is not acted on. Small
+   zero drift is taken up on waking
+
+   Registers of the ATmega328 are only used in the hal functions at the end of this file. On
+   other Arduino cores (ESP32, SAMD, STM32) the flow meter uses attachInterrupt(), the cut-off
+   is polled while waiting for the HX711 and the EEPROM is the emulated EEPROM of the core,
+   committed once per saved value. The 2 s fill watchdog uses the task watchdog on ESP32. SAMD,
+   STM32 and RP2040 have no fill watchdog: a hung HX711 still latches FAULT_TIMEOUT and stops
+   the pump, but a hang anywhere else leaves the pump running
+   The buttons and the HX711 are only touched in the hal functions too, and the display is of
+   class HAL_DISPLAY, so a host build can supply its own buttons, scale and display
+
+   A hall effect flow meter on FLOW_PIN is optional. When fitted, the scale reading is carried
+   forward between HX711 samples by the pulses counted since, so the relay is turned off at the
+   flow meter pulse rate. Counts per pulse are learned from the scale during every fill.
+
+   If the scale faults, modes whose flow rate was learned from healthy fills can still be
+   dispensed by time. The LCD shows 'TIMED' and the fault. Press MODE to select the mode and
+   DISPENSE to dose. Press MODE during a dose to abort it
+
 */
 
 #include <Arduino.h>
 #include <HX711.h>
 #include <LiquidCrystal.h>
 #include <EEPROM.h>
+#if defined(__AVR__)
+#include <avr/wdt.h>
+#include <avr/sleep.h>
+#define HAL_NOINIT __attribute__((section(".noinit")))
+#else
+#define HAL_NOINIT
+#endif
+#if defined(ESP32)
+#include <esp_task_wdt.h>
+#endif
+#if defined(ESP32) || defined(ESP8266)
+#define HAL_ISR IRAM_ATTR
+#else
+#define HAL_ISR
+#endif
+#ifndef HAL_DISPLAY
+#define HAL_DISPLAY LiquidCrystal
+#endif
+#ifndef clockCyclesPerMicrosecond
+#define clockCyclesPerMicrosecond() (F_CPU / 1000000L)
+#endif
 
 #define DISPENSE 2
 #define MODE 3
 #define RELAY_PIN 4
+#define THERMISTOR_PIN A6
+#define FLOW_PIN 12         // Hall effect flow meter output (PCINT4)
+#define VALVE_PIN 11        // Anti-drip valve, HIGH is open
+
+#define TEMP_REF 250        // Temperature in 0.1 degC to which all scale readings are corrected
+#define TEMP_INTERVAL 1000  // Thermistor update period in ms
+#define TC_ZERO 4           // Load cell zero drift in counts per degC. Take from load cell datasheet
+#define TC_SPAN 20          // Load cell span drift in ppm per degC. Take from load cell datasheet
+#define ZERO_ADDRESS 36     // EEPROM location of the empty platform reading
+#define LIN_POINTS 5        // Number of points in the linearization table
+#define LIN_ADDRESS 40      // EEPROM location of the linearization table
+#define ZERO_BAND 100       // Readings within this many counts of zero are an empty platform
+#define ZERO_LIMIT 2000     // Maximum counts the zero may be tracked away from calibration
+#define STABLE_BAND 20      // Maximum change in counts between readings of a stable platform
+#define STABLE_COUNT 10     // Number of stable readings before the zero is tracked
+#define CREEP_PPM 300       // Load cell creep at full settling in ppm of load. 0 disables
+#define CREEP_TAU 3000      // Creep time constant in readings (5 min at 10SPS)
+#define HX711_TIMEOUT 500   // Maximum time in ms to wait for HX711 data ready
+#define MAX_STEP 200000     // Largest plausible change in counts between two readings
+#define MAX_JUMPS 3         // Consecutive implausible readings before a fault is latched
+#define STUCK_COUNT 50      // Consecutive identical readings before a fault is latched
+
+#define FAULT_NONE 0
+#define FAULT_TIMEOUT 1     // DOUT never went low
+#define FAULT_SATURATED 2   // Reading at the end of the HX711 range, load cell open or overloaded
+#define FAULT_STUCK 3       // Reading does not change at all, DOUT stuck low
+#define FAULT_JUMP 4        // Reading changes faster than any load could
+#define FAULT_WELDED 5      // Mass keeps rising after the relay was turned off
+
+#define RELAY_ADDRESS 80    // EEPROM location of the relay cycle counter ring
+#define RELAY_SLOTS 16      // Number of slots in the relay cycle counter ring
+#define RELAY_LIFE 100000   // Rated electrical life of the relay in cycles
+#define RELAY_WARN 90       // Warn when this percentage of RELAY_LIFE is used
+#define DRIP_TIME 1000      // Time in ms after the relay turns off for drips to stop
+#define WELD_WINDOW 1000    // Time in ms after DRIP_TIME during which the mass must not rise
+#define WELD_RISE 200       // Rise in counts during WELD_WINDOW that means the pump is still running
+#define COUNTER_ADDRESS 144 // EEPROM location of the production counter ring
+#define COUNTER_SLOTS 8     // Number of records in the production counter ring
+#define COUNTER_SIZE 28     // Bytes per record: sequence, bottles[4], totalMl, runMinutes
+#define SHIFT_ADDRESS 368   // EEPROM location of the counters at the start of the shift
+#define RUNTIME_SAVE 15     // Save the runtime every this many minutes while idle
+#define BB_SIZE 160         // Number of 3 byte entries in the black box ring in RAM
+#define BB_SAVE 96          // Number of newest entries copied to EEPROM on a fault
+#define BB_ADDRESS 392      // EEPROM location of the saved black box
+#define BB_MAGIC 0x42424F58L
+
+//Black box event codes
+#define BB_RELAY_ON 1       // Data is the pump, 0 for the relay
+#define BB_RELAY_OFF 2      // Data is the pump, 0 for the relay
+#define BB_FAULT 3          // Data is the fault code
+#define BB_MODE 4           // Data is the mode index
+#define BB_BOOT 5           // Data is the reset flags (MCUSR on AVR)
+#define BB_TIMEOUT 6
+#define BB_DOSE 7           // Timed dose while faulted. Data is the mode index
+#define BB_RESET 0x7F       // Saved black box reason: reset while the relay was on
+
+//Message IDs, index of the text in MESSAGES[]
+#define MSG_TITLE           0
+#define MSG_SELECTED        1
+#define MSG_READING         2
+#define MSG_MODE            3
+#define MSG_TEMP            4
+#define MSG_MEDIAN          5
+#define MSG_DIFFERENCE      6
+#define MSG_MANUAL          7
+#define MSG_DISPENSING      8
+#define MSG_PRESS_CHANGE    9
+#define MSG_VOLUME          10
+#define MSG_ML              11
+#define MSG_BEGIN_CAL       12
+#define MSG_PLACE           13
+#define MSG_PRESS_VOL       14
+#define MSG_TO_FILL         15
+#define MSG_RELEASE         16
+#define MSG_TO_SAVE         17
+#define MSG_DONE            18
+#define MSG_SAVED           19
+#define MSG_VALUE_SAVED     20
+#define MSG_ENTERING_CAL    21
+#define MSG_CHOOSE          22
+#define MSG_PRESS_DISPENSE  23
+#define MSG_TO_CONFIRM      24
+#define MSG_INSPECT         25
+#define MSG_USE_VOL         26
+#define MSG_TO_TOGGLE       27
+#define MSG_USE_DISP        28
+#define MSG_TO_EXIT         29
+#define MSG_VOLUME_CAPS     30
+#define MSG_CURRENT         31
+#define MSG_EXITING         32
+#define MSG_ARRAY           33
+#define MSG_CONFIG_IMPORT   34
+#define MSG_INTERRUPTED     35
+#define MSG_FILTER          36
+#define MSG_SPS             37
+#define MSG_SD              38
+#define MSG_ZERO_OFF        39
+#define MSG_LOOP            40
+#define MSG_LOOP_MAX        41
+#define MSG_LOOP_MS         42
+#define MSG_COUNTS          43
+#define MSG_GRAMS           44
+#define MSG_NET_ML          45
+#define MSG_TO_TEACH        46
+#define MSG_CANCEL          47
+#define MSG_TEACH_MODE      48
+#define MSG_DISPENSE_SAVE   49
+#define MSG_MODE_NUM        50
+#define MSG_TAUGHT          51
+
+#define CURVE_EVERY 20      // Capture the fill curve of every this many bottles
+#define CURVE_ADDRESS 684   // EEPROM location of the stored fill curves
+#define CURVE_SLOTS 2       // Number of fill curves stored in EEPROM
+#define CURVE_SLOT_SIZE 100 // Bytes per stored curve including the header
+#define CURVE_HEADER 11     // seq, mode, step, points, length, first reading (4), duration (2)
+#define CURVE_BYTES 89      // Bytes of compressed readings per curve
+
+#define SPC_ADDRESS 884     // EEPROM location of the SPC center line and stop offset of each mode
+#define SPC_CONFIG 908      // EEPROM location of the SPC limits
+#define SPC_BASELINE 10     // Number of fills averaged to set the center line
+#define SPC_LAMBDA 3        // EWMA weight of a new result is 1 / 2^SPC_LAMBDA
+#define SPC_MAX_ERROR 4000  // Results further than this from the target are not fill results
+#define MAX_OFFSET 4000     // Largest stop offset in counts the SPC may set
+#define CHECKWEIGH_INDEX 4  // Position of checkweigher mode after the manual mode
+#define RECIPE_INDEX 5      // Position of recipe mode after checkweigher mode
+#define INGREDIENTS 3       // Number of ingredient pumps
+#define RECIPES 2           // Number of recipes
+#define RECIPE_ADDRESS 924  // EEPROM location of the learned stop offset of each ingredient
+#define RECIPE_GAIN 2       // Stop offset moves by 1 / RECIPE_GAIN of the error of each stage
+#define JOB_INDEX 6         // Position of batch jobs after recipe mode
+#define JOB_SLOTS 4         // Number of jobs in the queue
+#define PRIME_INDEX 7       // Position of pump priming after batch jobs
+#define PRIME_ADDRESS 960   // EEPROM location of the learned hose delay
+#define PRIME_RISE 200      // Rise in counts that means liquid reached the container
+#define PRIME_PURGE 1000    // Time in ms the pump keeps running after flow is seen to purge air
+#define PRIME_TIMEOUT 20000 // Longest time in ms to wait for flow while priming
+#define PRIME_DELAY_MAX 2000 // Longest hose delay in ms with the hose full
+#define VALVE_ADDRESS 964   // EEPROM location of the valve close offset and auto tune
+#define VALVE_OFFSET 100    // Default time in ms the valve closes after the pump turns off
+#define VALVE_MAX 500       // Latest the valve may close in ms after the pump. Below DRIP_TIME
+#define VALVE_STEP 10       // Change of the offset in ms per tuned fill
+#define VALVE_DRIP 50       // Largest drip in counts after the valve closes while tuning
+#define VALVE_LATE 500      // Drip readings later than this many ms after DRIP_TIME are not tuned on
+#define PREDICT_ADDRESS 972 // EEPROM location of the sub-sample cut-off setting
+#define PREDICT_MAX 1000    // Longest time in ms Timer1 may be set to turn the relay off
+#define EEPROM_SIZE 1024    // Bytes of EEPROM, emulated in flash on 32-bit boards
+#define BENCH_RUNS 200      // Calls timed per path by the BENCH command
+#define IDLE_MINUTES 10     // Sleep after this many minutes without activity. 0 disables
+#define WAKE_BAND 400       // Largest zero change in counts taken up on waking
+#define STACK_CANARY 0xC5   // Fill of the unused RAM, to find the deepest the stack has been
+#define CONFIG_VERSION 3    // Layout of the config snapshot. Change when CONFIG_REGIONS changes
+#define CONFIG_BYTES 188    // Bytes of EEPROM in CONFIG_REGIONS
+#define FILTER_ADDRESS 976  // EEPROM location of the median filter window
+#define MEDIAN_MAX 9        // Largest median filter window
+#define NOISE_SAMPLES 32    // Readings per noise measurement
+#define NOISE_TARGET 50     // Standard deviation in counts the median of a fill must reach
+#define NOISE_MIN 5         // Fewest reading differences the noise is measured from
+#define DIAG_WINDOW 1000    // Time in ms over which the live diagnostics are taken
+#define INSPECT_PAGES 10    // Pages of inspect contents, the last two are the diagnostics
+#define MANUAL_DENSITY 1000 // Density in g/L used to show the volume in manual mode
+#define SETTLE_MAX 5000     // Longest time in ms to wait for the scale to settle after a manual fill
+#define TEACH_WAIT 3000     // Time in ms after a manual fill during which MODE starts teach-in
+#define VOLUME_ADDRESS 980  // EEPROM location of the taught volume of each mode
+#define CONFIG_TIMEOUT 2000 // Time in ms to receive a snapshot after CONFIG IMPORT
+#define CONFIG_FLAG 1023    // EEPROM location of the flag set while a snapshot is written
+#define CONFIG_PENDING 0xA5
+#define FLOW_PER_L 450      // Flow meter pulses per litre. Take from flow meter datasheet
+#define FLOW_MIN_PULSES 20  // Pulses in a fill before counts per pulse are measured from the scale
+#define FLOW_TIMEOUT 500    // Flow is zero if there was no pulse for this many ms
+#define FLOW_ADDRESS 936    // EEPROM location of the learned counts per pulse of each mode
+#define FLOW_GAIN 4         // Learned counts per pulse moves by 1 / FLOW_GAIN of each fill
+#define DOSE_ADDRESS 948    // EEPROM location of the learned flow rate of each mode
+#define DOSE_GAIN 4         // Learned flow rate moves by 1 / DOSE_GAIN of each fill
+#define DOSE_MIN_TIME 500   // Fills shorter than this many ms do not teach the flow rate
+#define DOSE_MAX_TIME 60000 // Longest timed dose in ms
 
 void control(long localVal);
 void updateMode(int localIndex);
 void calibrateFunction(int localIndex);
 void EEPROMWrite(int address, long value);
 long EEPROMRead(long address);
-int selection();
+int selection(bool calibration, const __FlashStringHelper *heading);
 void inspectContents();
 byte DebounceSwitch();
+long readScale();
+long readAverage(byte times);
+void updateTemperature();
+int lookupTemperature(int adc);
+int densityPpm(int localTemp);
+long fillThreshold(int localIndex);
+long linearize(long reading);
+void loadLinearization();
+void linearizeFunction();
+void waitForDispense();
+void trackZero(long reading);
+long readRaw();
+void setFault(byte fault);
+void showFault();
+void setRelay(bool on);
+void checkWeld(long reading);
+long ringRead(int base, byte slots);
+void ringWrite(int base, byte slots, long value);
+void loadCounters();
+void saveCounters();
+void countFill(byte localIndex);
+void updateRuntime();
+void resetShift();
+void printStats();
+void serialCommands();
+void blackBoxBoot(byte resetCause);
+void blackBoxSample(long raw);
+void blackBoxEvent(byte code, int data);
+void saveBlackBox(byte reason);
+void printBlackBox(bool live);
+void printBlackBoxEntry(byte b0, byte b1, byte b2);
+void curveBegin();
+void curveSample(long reading);
+void curveDecimate();
+void curveFinish();
+void printCurves();
+byte putVarint(byte *buffer, long value);
+byte getVarint(const byte *buffer, long *value);
+void spcResult(long settled);
+void spcReset(byte localIndex);
+void printSpc();
+bool updateStable(long reading);
+void checkweigh();
+long readMedian(byte n);
+void setPump(byte pump, bool on);
+long countsPerKg();
+void runRecipe();
+void dispense(long threshold);
+bool addJob(byte mode, int count);
+void jobFillDone();
+void editJobs();
+void printJobs();
+unsigned long flowCount();
+int flowMlPerS();
+void flowBegin(long stopAt);
+void flowWeight(long reading);
+void flowCheck();
+void flowEnd();
+long flowDensity(long cpp);
+void printFlow();
+void doseLearn(byte localIndex, long fillMass);
+void timedDoseLoop();
+void timedDose(byte localIndex);
+void printDose();
+void primePump();
+long measureHoseDelay();
+void updateValve();
+void valveDrip(long reading);
+void printValve();
+long predictCutoff(long remaining, long rise, long interval, long age);
+void scheduleCutoff(long due);
+void cancelCutoff();
+void cutoffCheck();
+long medianOf(long *values, byte n);
+void flowPulse();
+void runBench();
+void printBench(const __FlashStringHelper *name, unsigned long elapsed);
+byte halResetCause();
+void halStorageBegin();
+void halStorageWrite(int address, byte value);
+void halStorageCommit();
+void cutoffInterrupt();
+bool halTimerStart(long due);
+void halTimerStop();
+byte halButton(byte pin);
+void halScaleBegin();
+bool halScaleReady();
+long halScaleRead();
+void halScalePower(bool on);
+void halWatchdog(bool on);
+void halWatchdogReset();
+void halFlowBegin();
+void checkIdle();
+void idleSleep();
+void halSleep();
+void printMsg(Print &out, byte id);
+void printMemory();
+void printMemoryLine(const __FlashStringHelper *name, long bytes);
+long halStaticRam();
+long halFreeRam();
+long halStackUnused();
+long halStackPeak();
+long halFlashUsed();
+void loadSettings();
+uint16_t crc16(uint16_t crc, byte value);
+void exportConfig();
+void importConfig();
+long measureNoise(byte samples);
+long noiseSigma(float sum, float sumSquares, byte n);
+void runNoise();
+byte filterWindow(long sigma);
+void printNoise();
+void loopTiming();
+void diagSample(long reading);
+void diagPublish();
+void diagSkip();
+void printDiag();
+long manualFill();
+void printNet(Print &out, long net, long cpk);
+void teachPrompt();
+bool teachMode(byte localIndex);
 
 
 const int LOADCELL_DOUT = 5;
 const int LOADCELL_SCK = 6;
 
 const int rs = A1, en = A3, d4 = A4, d5 = A5, d6 = 7, d7 = 8;
-LiquidCrystal lcd(rs, en, d4, d5, d6, d7);
+HAL_DISPLAY lcd(rs, en, d4, d5, d6, d7);
 
 HX711 scale;
 //Initialize val[] to values;
 long val[] = {220000, 240000, 250000, -1};
 int address[] = {0, 4, 8};
 int VOLUME[] = {200, 450, 900};
-byte index = 0;
+int TOLERANCE[] = {4, 9, 18};   // Checkweigher tolerance of each mode in mL
+
+//Ingredient 1 uses the main relay
+const byte PUMP_PINS[INGREDIENTS] = {RELAY_PIN, 9, 10};
+const int RECIPE_VOLUME[RECIPES] = {500, 1000};     // Total volume of the recipe in mL
+const int RECIPE_DENSITY[RECIPES] = {1000, 1000};   // Density of the finished mix in g/L
+//Parts by weight of each ingredient
+const byte RECIPE_PARTS[RECIPES][INGREDIENTS] = {
+  {70, 30, 0},
+  {50, 25, 25}
+};
+long recipeOffset[] = {0, 0, 0};  // Learned stop offset of each ingredient in counts
+
+//Batch job queue. The job being run is always jobMode[0]
+const int JOB_COUNTS[] = {1, 6, 12, 24, 48, 100};   // Bottle counts offered on the front panel
+byte jobMode[JOB_SLOTS];
+int jobCount[JOB_SLOTS];
+byte jobLength = 0;
+int jobDone = 0;              // Bottles filled in the current job
+bool jobRunning = false;
+bool jobArmed = false;        // Platform was empty since the last fill
+byte modeIndex = 0;
 int selectedMode = 0;
 
+//EEPROM map
+//  0 - 11 : threshold of each mode (address[])
+// 12 - 23 : container reading before filling during calibration (tareAddress[])
+// 24 - 35 : liquid temperature during calibration in 0.1 degC (tempAddress[])
+// 36 - 39 : empty platform reading (ZERO_ADDRESS)
+// 40 - 79 : linearization table, reading above zero and correction of each point (LIN_ADDRESS)
+// 80 - 143: relay cycle counter, wear leveled over RELAY_SLOTS slots (RELAY_ADDRESS)
+//144 - 367: production counter records, wear leveled over COUNTER_SLOTS slots (COUNTER_ADDRESS)
+//368 - 391: bottles[4], totalMl and runMinutes at the start of the shift (SHIFT_ADDRESS)
+//392 - 683: black box saved on fault, reason, entry count, 2 spare, BB_SAVE entries (BB_ADDRESS)
+//684 - 883: last CURVE_SLOTS fill curves, CURVE_HEADER bytes and compressed readings (CURVE_ADDRESS)
+//884 - 907: SPC center line and stop offset of each mode (SPC_ADDRESS)
+//908 - 923: SPC EWMA limit, CUSUM k, CUSUM h and auto adjust (SPC_CONFIG)
+//924 - 935: learned stop offset of each recipe ingredient (RECIPE_ADDRESS)
+//936 - 947: learned scale counts per flow meter pulse of each mode (FLOW_ADDRESS)
+//948 - 959: learned flow rate of each mode in uL/s (DOSE_ADDRESS)
+//960 - 963: learned hose delay in ms (PRIME_ADDRESS)
+//964 - 971: valve close offset in ms and auto tune (VALVE_ADDRESS)
+//972 - 975: sub-sample cut-off on or off (PREDICT_ADDRESS)
+//976 - 979: median filter window of fills (FILTER_ADDRESS)
+//980 - 991: volume of each mode in mL set by teach-in (VOLUME_ADDRESS)
+//1023     : config snapshot being written (CONFIG_FLAG)
+//Config snapshots cover 0 - 79 and 884 - 991, the rest is logs and counters of this machine
+const int CONFIG_REGIONS[][2] = {{0, 80}, {SPC_ADDRESS, 108}};
+int tareAddress[] = {12, 16, 20};
+int tempAddress[] = {24, 28, 32};
+long calTare[] = { -1, -1, -1};
+long calTemp[] = { -1, -1, -1};
+long scaleZero = 0;
+
+//Text of each message ID
+const char TEXT_TITLE[] PROGMEM = "Dispense machine  ";
+const char TEXT_SELECTED[] PROGMEM = "Selected mode is ";
+const char TEXT_READING[] PROGMEM = "HX711 reading: ";
+const char TEXT_MODE[] PROGMEM = "Mode:";
+const char TEXT_TEMP[] PROGMEM = "\tTemp:";
+const char TEXT_MEDIAN[] PROGMEM = "Median : ";
+const char TEXT_DIFFERENCE[] PROGMEM = "\tDifference: ";
+const char TEXT_MANUAL[] PROGMEM = "Manual Mode     ";
+const char TEXT_DISPENSING[] PROGMEM = "Dispensing";
+const char TEXT_PRESS_CHANGE[] PROGMEM = "Press to change";
+const char TEXT_VOLUME[] PROGMEM = "Volume: ";
+const char TEXT_ML[] PROGMEM = "  mL      ";
+const char TEXT_BEGIN_CAL[] PROGMEM = "Begin Calibration";
+const char TEXT_PLACE[] PROGMEM = "Place container   ";
+const char TEXT_PRESS_VOL[] PROGMEM = "Press VOL button   ";
+const char TEXT_TO_FILL[] PROGMEM = "to fill     ";
+const char TEXT_RELEASE[] PROGMEM = "Release    ";
+const char TEXT_TO_SAVE[] PROGMEM = "to save value  ";
+const char TEXT_DONE[] PROGMEM = "Done";
+const char TEXT_SAVED[] PROGMEM = "Saved: ";
+const char TEXT_VALUE_SAVED[] PROGMEM = "Value saved is: ";
+const char TEXT_ENTERING_CAL[] PROGMEM = "Entering Calib";
+const char TEXT_CHOOSE[] PROGMEM = "Choose Volume";
+const char TEXT_PRESS_DISPENSE[] PROGMEM = "Press DISPENSE ";
+const char TEXT_TO_CONFIRM[] PROGMEM = "to confirm ";
+const char TEXT_INSPECT[] PROGMEM = "Inspect Contents ";
+const char TEXT_USE_VOL[] PROGMEM = "Use VOL button   ";
+const char TEXT_TO_TOGGLE[] PROGMEM = "to toggle";
+const char TEXT_USE_DISP[] PROGMEM = "Use DISP button";
+const char TEXT_TO_EXIT[] PROGMEM = "to exit";
+const char TEXT_VOLUME_CAPS[] PROGMEM = "VOLUME: ";
+const char TEXT_CURRENT[] PROGMEM = "Current val:     ";
+const char TEXT_EXITING[] PROGMEM = "Exiting...";
+const char TEXT_ARRAY[] PROGMEM = "Array ";
+const char TEXT_CONFIG_IMPORT[] PROGMEM = "Config import   ";
+const char TEXT_INTERRUPTED[] PROGMEM = "interrupted     ";
+const char TEXT_FILTER[] PROGMEM = "Filter n=";
+const char TEXT_SPS[] PROGMEM = "SPS ";
+const char TEXT_SD[] PROGMEM = " sd ";
+const char TEXT_ZERO_OFF[] PROGMEM = "Zero off: ";
+const char TEXT_LOOP[] PROGMEM = "Loop ";
+const char TEXT_LOOP_MAX[] PROGMEM = " max ";
+const char TEXT_LOOP_MS[] PROGMEM = "ms    ";
+const char TEXT_COUNTS[] PROGMEM = " counts";
+const char TEXT_GRAMS[] PROGMEM = " g ";
+const char TEXT_NET_ML[] PROGMEM = " mL";
+const char TEXT_TO_TEACH[] PROGMEM = "MODE to teach   ";
+const char TEXT_CANCEL[] PROGMEM = "Cancel          ";
+const char TEXT_TEACH_MODE[] PROGMEM = "Teach mode ";
+const char TEXT_DISPENSE_SAVE[] PROGMEM = "DISPENSE to save";
+const char TEXT_MODE_NUM[] PROGMEM = "Mode ";
+const char TEXT_TAUGHT[] PROGMEM = " taught";
+const char *const MESSAGES[] PROGMEM = {
+  TEXT_TITLE, TEXT_SELECTED, TEXT_READING, TEXT_MODE, TEXT_TEMP, TEXT_MEDIAN, TEXT_DIFFERENCE,
+  TEXT_MANUAL, TEXT_DISPENSING, TEXT_PRESS_CHANGE, TEXT_VOLUME, TEXT_ML, TEXT_BEGIN_CAL,
+  TEXT_PLACE, TEXT_PRESS_VOL, TEXT_TO_FILL, TEXT_RELEASE, TEXT_TO_SAVE, TEXT_DONE, TEXT_SAVED,
+  TEXT_VALUE_SAVED, TEXT_ENTERING_CAL, TEXT_CHOOSE, TEXT_PRESS_DISPENSE, TEXT_TO_CONFIRM,
+  TEXT_INSPECT, TEXT_USE_VOL, TEXT_TO_TOGGLE, TEXT_USE_DISP, TEXT_TO_EXIT, TEXT_VOLUME_CAPS,
+  TEXT_CURRENT, TEXT_EXITING, TEXT_ARRAY, TEXT_CONFIG_IMPORT, TEXT_INTERRUPTED, TEXT_FILTER,
+  TEXT_SPS, TEXT_SD, TEXT_ZERO_OFF, TEXT_LOOP, TEXT_LOOP_MAX, TEXT_LOOP_MS, TEXT_COUNTS,
+  TEXT_GRAMS, TEXT_NET_ML, TEXT_TO_TEACH, TEXT_CANCEL, TEXT_TEACH_MODE, TEXT_DISPENSE_SAVE,
+  TEXT_MODE_NUM, TEXT_TAUGHT
+};
+
+//Thermistor temperature in 0.1 degC at every 32 ADC counts (0 to 1024)
+//10k NTC (B = 3950) to GND with a 10k pull-up to 5V
+const int THERMISTOR_TABLE[] PROGMEM = {
+  1500, 1293, 1016, 866, 763, 685, 621, 567, 520, 477, 439,
+  403, 370, 338, 308, 278, 250, 222, 194, 167, 139, 111,
+  83, 53, 22, -11, -47, -87, -132, -186, -256, -364, -400
+};
+//Density of the liquid relative to its density at 20 degC in ppm, every 5 degC from 0 to 50 degC
+//Values are for water. Replace with the table of the liquid being dispensed
+const int DENSITY_TABLE[] PROGMEM = {
+  1638, 1763, 1498, 897, 0, -1161, -2561, -4180, -5999, -8005, -10186
+};
+int temperature = TEMP_REF;   // Last thermistor temperature in 0.1 degC
+bool tempValid = false;       // False when the thermistor is missing, open or shorted
+long tcOffset = 0;            // Zero correction in counts for the current temperature
+long tcSpan = 0;              // Span correction for the current temperature (Q16)
+
+//Reference masses in grams placed on the platform during linearization. First point must be 0
+const int LIN_MASS[LIN_POINTS] = {0, 100, 250, 500, 1000};
+long linRaw[LIN_POINTS];      // Reading above scaleZero at each reference mass
+long linCorr[LIN_POINTS];     // Counts to add at each point to land on the straight line
+long linSlope[LIN_POINTS];    // Slope of the correction between point i and i + 1 (Q16)
+bool linValid = false;
+
+long zeroOffset = 0;          // Drift of the empty platform reading from scaleZero, tracked while idle
+long creepQ16 = 0;            // Modelled creep of the load cell in counts (Q16)
+
+byte machineFault = FAULT_NONE; // Latched until power is cycled
+
+bool relayState = false;
+long relayCycles = 0;
+byte weldState = 0;           // 0: idle, 1: waiting for drips to stop, 2: watching for a rise
+unsigned long relayOffTime = 0;
+unsigned long relayOnTime = 0;
+unsigned long relayRunTime = 0; // Time in ms the relay was on for the last time
+long weldBaseline = 0;
+
+//Production counters. Index 3 of bottles[] counts manual fills
+long counterSeq = 0;
+long bottles[] = {0, 0, 0, 0};
+long totalMl = 0;
+long runMinutes = 0;
+long shiftBottles[] = {0, 0, 0, 0};
+long shiftMl = 0;
+long shiftMinutes = 0;
+
+//Black box of the last raw readings and events. Kept in .noinit so it survives a watchdog reset
+//on AVR. Other boards clear it on every reset and it only covers the time since.
+//Entry: bit 23 clear is a raw reading >> 1, bit 23 set is an event (code in bits 16-22, data below)
+byte bbRing[BB_SIZE * 3] HAL_NOINIT;
+int bbHead HAL_NOINIT;
+int bbCount HAL_NOINIT;
+byte bbPumps HAL_NOINIT;       // Pumps on, one bit per pump, to find a reset while dispensing
+long bbMagic HAL_NOINIT;
+
+//Fill curve being captured. The first reading is kept as is, the rest as zigzag varint
+//deltas. When the buffer is full every other point is dropped and curveStep is doubled.
+byte curveBuffer[CURVE_BYTES];
+byte curveLength = 0;         // Bytes used in curveBuffer
+byte curvePoints = 0;         // Points stored, including the first reading
+byte curveStep = 1;           // Readings per stored point
+byte curveCountdown = 0;      // Readings until the next point is stored
+long curveFirst = 0;
+long curveLast = 0;
+bool curveActive = false;
+bool curveRequest = false;    // Capture the next fill regardless of CURVE_EVERY
+byte curveSeq = 0;
+unsigned long curveStartTime = 0;
+
+//Statistical process control of the settled fill result (settled reading - threshold).
+//Results are compared to a center line learned from the first SPC_BASELINE fills.
+byte fillMode = 255;          // Mode of the fill waiting for its settled result, 255 for none
+long fillTarget = 0;
+long stopOffset[] = {0, 0, 0};  // Relay turns off this many counts before the threshold
+long spcCenter[] = {0, 0, 0};
+byte spcCount[] = {0, 0, 0};    // Results averaged into the center line so far
+long spcEwma[] = {0, 0, 0};     // EWMA of the deviation from the center line (x16)
+long spcHigh[] = {0, 0, 0};     // Upper CUSUM
+long spcLow[] = {0, 0, 0};      // Lower CUSUM
+bool spcAlarm[] = {false, false, false};
+long spcEwmaLimit = 60;
+long spcK = 20;
+long spcH = 100;
+bool spcAutoAdjust = true;
+
+long stableReading = 0;       // Last reading seen by updateStable()
+byte stableCount = 0;         // Consecutive readings within STABLE_BAND of the previous one
+
+//Flow meter. During a fill the last median reading is carried forward by the pulses counted
+//since it was taken, so the stop decision is not limited to the HX711 sample rate
+volatile unsigned long flowPulses = 0;
+volatile unsigned long flowPulseTime = 0;   // micros() of the last pulse
+volatile unsigned long flowPeriod = 0;      // Time between the last two pulses in us
+long flowCpp[] = {0, 0, 0};   // Learned scale counts per pulse of each mode (Q8), 0 if unknown
+long flowRate = 0;            // Counts per pulse used in the current fill (Q8)
+bool flowActive = false;
+bool flowStopped = false;     // Relay was turned off by the flow meter
+long flowStopAt = 0;
+long flowMass = -1;           // Last median reading of the fill, -1 before the first
+unsigned long flowRefPulses = 0;    // Pulses counted when flowMass was read
+long flowStartMass = 0;
+unsigned long flowStartPulses = 0;
+
+long doseRate[] = {0, 0, 0};  // Learned flow rate of each mode in uL/s, 0 if unknown
+
+long hoseDelay = 0;           // Time in ms from pump on to the first rise of the mass, hose full
+long stopLead = 0;            // Counts still to arrive when the relay turns off, from hoseDelay
+
+long valveOffset = VALVE_OFFSET;  // Time in ms the valve closes after the pump turns off
+bool valveAuto = true;
+byte valveState = 0;          // 0: idle, 1: close pending, 2: closed, measuring the drip
+long valveReading = 0;        // Last reading when the valve closed
+bool valveTune = false;       // The last pump run was an automatic fill, so its drip may tune
+long scaleReading = 0;        // Last reading returned by readScale()
+unsigned long medianTime = 0; // millis() of the middle reading of the last readMedian()
+
+//Sub-sample cut-off. Timer1 turns the relay off at the predicted crossing of the stop point
+bool cutoffPredict = false;
+volatile bool cutoffFired = false;
+volatile unsigned long cutoffTime = 0;  // millis() when Timer1 turned the relay off
+
+byte medianWindow = 3;        // Readings per median during fills, always odd
+long noiseOff = -1;           // Standard deviation of readings with the pump off, -1 if not measured
+long noiseOn = -1;            // Standard deviation of readings with the pump running
+
+//Live diagnostics. Readings are taken relative to the first of each window to keep the float
+//sums accurate
+unsigned long diagStart = 0;
+int diagCount = 0;
+long diagBase = 0;
+float diagSum = 0;
+float diagSumSquares = 0;
+long diagMin = 0;
+long diagMax = 0;
+int diagRate = 0;             // Samples per second of the last window (x10)
+long diagSd = 0;              // Standard deviation of the last window in counts
+long diagLow = 0;             // Smallest reading of the last window
+long diagHigh = 0;            // Largest reading of the last window
+unsigned long loopLast = 0;   // micros() at the start of the last loop
+unsigned long loopPeriod = 0; // Average loop time in us
+unsigned long loopWorst = 0;  // Longest loop time in us since power up
+
+//Last manual fill, measured by manualFill()
+long manualTare = -1;         // Reading when DISPENSE was pressed
+long manualNet = -1;          // Net counts once settled, -1 if not measured
+long manualDrip = 0;          // Counts that arrived after the relay turned off
+unsigned long manualSettle = 0; // Time in ms from relay off until the reading stopped moving
+bool cutoffArmed = false;     // Cut-off is polled on boards without Timer1
+unsigned long cutoffStart = 0;
+unsigned long cutoffDue = 0;
+bool configPending = false;    // An interrupted config import left the EEPROM half written
+bool halStorageDirty = false;  // EEPROM changed since the last commit on flash emulated boards
+
 void setup() {
 
+  byte resetCause = halResetCause();
+  halWatchdog(false);
+  halStorageBegin();
   Serial.begin(9600);
-  scale.begin(LOADCELL_DOUT, LOADCELL_SCK);
+  blackBoxBoot(resetCause);
+  halScaleBegin();
   pinMode(DISPENSE, INPUT_PULLUP);
   pinMode(MODE, INPUT_PULLUP);
   pinMode(RELAY_PIN, OUTPUT);
+  for (byte i = 1; i < INGREDIENTS; i++) {
+    pinMode(PUMP_PINS[i], OUTPUT);
+    digitalWrite(PUMP_PINS[i], LOW);
+  }
   pinMode(A7, INPUT);
   pinMode(A6, INPUT);
   pinMode(A2, OUTPUT);
   digitalWrite(A2, LOW);
+  pinMode(VALVE_PIN, OUTPUT);
+  digitalWrite(VALVE_PIN, LOW);
+  halFlowBegin();
 
   lcd.begin(16, 2);
   lcd.setCursor(0, 0);
-  lcd.println("Dispense machine  ");
+  printMsg(lcd, MSG_TITLE);
   lcd.setCursor(0, 1);
-  lcd.println("V1.3  ");
+  lcd.println(F("V1.28 "));
   delay(800);
   lcd.clear();
 
   //If both buttons are pressed while switching on, enter calibration mode
-  if (digitalRead(DISPENSE) == 0 && digitalRead(MODE) == 0) {
-    selectedMode = selection();
-    Serial.print("Selected mode is ");
+  if (halButton(DISPENSE) == 0 && halButton(MODE) == 0) {
+    //Thresholds are compared with linearized readings, so they must be recorded linearized
+    scaleZero = EEPROMRead(ZERO_ADDRESS);
+    loadLinearization();
+    selectedMode = selection(true, NULL);
+    printMsg(Serial, MSG_SELECTED);
     Serial.print(selectedMode + 1);
-    calibrateFunction(selectedMode);
+    if (selectedMode == 3) {
+      linearizeFunction();
+    }
+    else {
+      calibrateFunction(selectedMode);
+    }
+  }
+  loadSettings();
+  relayCycles = ringRead(RELAY_ADDRESS, RELAY_SLOTS);
+  loadCounters();
+  if (EEPROM.read(CONFIG_FLAG) == CONFIG_PENDING) {
+    Serial.println(F("Config import was interrupted, import it again"));
+    configPending = true;
   }
+  //Continue the curve sequence from the newest stored curve. The first valid slot is the
+  //starting point, as sequence numbers wrap and none of them is newer than all others
+  bool curveFound = false;
+  for (byte i = 0; i < CURVE_SLOTS; i++) {
+    byte seq = EEPROM.read(CURVE_ADDRESS + CURVE_SLOT_SIZE * i);
+    if (EEPROM.read(CURVE_ADDRESS + CURVE_SLOT_SIZE * i + 4) > CURVE_BYTES) {
+      continue;
+    }
+    if (!curveFound || (int8_t)(seq - curveSeq) > 0) {
+      curveSeq = seq;
+      curveFound = true;
+    }
+  }
+
+  //If any one of the buttons is pressed while switching on, enter inspection mode
+  if ((halButton(MODE)^halButton(DISPENSE)) == 1) {
+    inspectContents();
+  }
+  updateMode(modeIndex);
+}
+
+/*
+  Loads the calibration, learned offsets and settings from EEPROM. Called at power up and
+  after a config snapshot is imported
+  INPUTS:
+    Nil
+  OUTPUTS:
+    Nil
+*/
+void loadSettings() {
   //Set threshold value to the value saved in EEPROM 
   for (byte i = 0; i < 3; i++) {
     val[i] = EEPROMRead(address[i]);
+    calTare[i] = EEPROMRead(tareAddress[i]);
+    calTemp[i] = EEPROMRead(tempAddress[i]);
     Serial.println(val[i]);
+    long volume = EEPROMRead(VOLUME_ADDRESS + 4 * i);
+    if (volume > 0 && volume <= 32767) {
+      VOLUME[i] = volume;
+    }
   }
-
-  //If any one of the buttons is pressed while switching on, enter inspection mode
-  if ((digitalRead(MODE)^digitalRead(DISPENSE)) == 1) {
-    inspectContents();
+  scaleZero = EEPROMRead(ZERO_ADDRESS);
+  loadLinearization();
+  for (byte i = 0; i < 3; i++) {
+    spcCenter[i] = EEPROMRead(SPC_ADDRESS + 8 * i);
+    stopOffset[i] = EEPROMRead(SPC_ADDRESS + 8 * i + 4);
+    //No center line learned yet. spcReset() and erased EEPROM leave both at -1, teach-in
+    //leaves the center at -1 with the initial stop offset
+    if (spcCenter[i] == -1 || labs(stopOffset[i]) > MAX_OFFSET) {
+      spcCenter[i] = 0;
+      if (stopOffset[i] == -1 || labs(stopOffset[i]) > MAX_OFFSET) {
+        stopOffset[i] = 0;
+      }
+      spcCount[i] = 0;
+    }
+    else {
+      spcCount[i] = SPC_BASELINE;
+    }
+  }
+  for (byte i = 0; i < 3; i++) {
+    flowCpp[i] = EEPROMRead(FLOW_ADDRESS + 4 * i);
+    if (flowCpp[i] <= 0) {
+      flowCpp[i] = 0;
+    }
+    doseRate[i] = EEPROMRead(DOSE_ADDRESS + 4 * i);
+    if (doseRate[i] <= 0) {
+      doseRate[i] = 0;
+    }
+  }
+  if (EEPROMRead(VALVE_ADDRESS) != -1) {
+    valveOffset = constrain(EEPROMRead(VALVE_ADDRESS), 0L, (long)VALVE_MAX);
+    valveAuto = EEPROMRead(VALVE_ADDRESS + 4) != 0;
+  }
+  cutoffPredict = EEPROMRead(PREDICT_ADDRESS) == 1;
+  medianWindow = 3;
+  long window = EEPROMRead(FILTER_ADDRESS);
+  if (window >= 1 && window <= MEDIAN_MAX && window % 2 == 1) {
+    medianWindow = window;
+  }
+  hoseDelay = EEPROMRead(PRIME_ADDRESS);
+  if (hoseDelay < 0 || hoseDelay > PRIME_DELAY_MAX) {
+    hoseDelay = 0;
+  }
+  for (byte i = 0; i < INGREDIENTS; i++) {
+    recipeOffset[i] = EEPROMRead(RECIPE_ADDRESS + 4 * i);
+    if (labs(recipeOffset[i]) > MAX_OFFSET) {
+      recipeOffset[i] = 0;
+    }
+  }
+  if (EEPROMRead(SPC_CONFIG) != -1) {
+    spcEwmaLimit = EEPROMRead(SPC_CONFIG);
+    spcK = EEPROMRead(SPC_CONFIG + 4);
+    spcH = EEPROMRead(SPC_CONFIG + 8);
+    spcAutoAdjust = EEPROMRead(SPC_CONFIG + 12) != 0;
   }
-  updateMode(index);
 }
 
 void loop() {
+  loopTiming();
 
-  int switchState = DebounceSwitch();
-  long reading = scale.read() * -1;
-  Serial.print("HX711 reading: ");
-  Serial.print(reading);
-  Serial.print("\t");
-  Serial.print("Mode:");
-  Serial.print(index + 1);
-  Serial.print("\t");
-  Serial.println(val[index]);
-  if (digitalRead(DISPENSE) == 0 && reading < val[index]) {
-    lcd.clear();
+  //A half written config is not used for fills until a snapshot is imported again
+  if (configPending) {
     lcd.setCursor(0, 0);
-    lcd.print("Dispensing");
+    printMsg(lcd, MSG_CONFIG_IMPORT);
     lcd.setCursor(0, 1);
-    lcd.print(VOLUME[index]);
-    lcd.print("               ");
-    digitalWrite(LED_BUILTIN, HIGH);
-    digitalWrite(RELAY_PIN, HIGH);
-    control(val[index]);
+    printMsg(lcd, MSG_INTERRUPTED);
+    serialCommands();
+    delay(100);
+    return;
+  }
+
+  if (machineFault != FAULT_NONE) {
+    //Close the valve after a timed dose, the scale cannot show a leak
+    updateValve();
+    if (valveState == 2) {
+      valveState = 0;
+    }
+    showFault();
+    //Without a scale the pump can still be run by time, but not with a welded relay
+    if (machineFault != FAULT_WELDED) {
+      timedDoseLoop();
+    }
+    else {
+      //BBOX LIVE and the other commands stay available to diagnose the weld
+      serialCommands();
+    }
+    return;
+  }
+  int switchState = DebounceSwitch();
+  long reading = readScale();
+  long threshold = modeIndex < CHECKWEIGH_INDEX ? fillThreshold(modeIndex) : -1;
+  diagSample(reading);
+  diagPublish();
+  bool autoStart = false;
+  trackZero(reading);
+  checkIdle();
+  valveDrip(reading);
+  checkWeld(reading);
+  //Keep capturing the curve while drips settle after cut-off
+  if (curveActive) {
+    curveSample(reading);
+    if (millis() - relayOffTime >= DRIP_TIME) {
+      curveFinish();
+    }
+  }
+  updateRuntime();
+  serialCommands();
+  //A stable container on the empty platform starts the next fill of the job
+  if (jobRunning) {
+    if (reading < scaleZero + ZERO_BAND) {
+      jobArmed = true;
+    }
+    else if (jobArmed && stableCount >= STABLE_COUNT) {
+      autoStart = true;
+    }
+  }
+  printMsg(Serial, MSG_READING);
+  Serial.print(reading);
+  Serial.print('\t');
+  printMsg(Serial, MSG_MODE);
+  Serial.print(modeIndex + 1);
+  Serial.print('\t');
+  Serial.print(threshold);
+  printMsg(Serial, MSG_TEMP);
+  Serial.println(temperature);
+  if (modeIndex >= CHECKWEIGH_INDEX) {
+    if (halButton(DISPENSE) == 0) {
+      if (modeIndex == CHECKWEIGH_INDEX) {
+        checkweigh();
+      }
+      else if (modeIndex == RECIPE_INDEX) {
+        runRecipe();
+      }
+      else if (modeIndex == JOB_INDEX) {
+        editJobs();
+      }
+      else {
+        primePump();
+      }
+      lcd.clear();
+      updateMode(modeIndex);
+      diagSkip();
+    }
+  }
+  else if ((halButton(DISPENSE) == 0 || autoStart) && (threshold == -1 || reading < threshold) && machineFault == FAULT_NONE) {
+    dispense(threshold);
+    if (threshold == -1 && manualNet > 0) {
+      teachPrompt();
+    }
+    diagSkip();
   }
   if (switchState == 1) {
-    index++;
-    if (index > 3) {
-      index = 0;
+    if (jobRunning) {
+      jobRunning = false;
+      Serial.println(F("Jobs paused"));
+    }
+    modeIndex++;
+    if (modeIndex > PRIME_INDEX) {
+      modeIndex = 0;
     }
-    updateMode(index);
+    blackBoxEvent(BB_MODE, modeIndex);
+    updateMode(modeIndex);
     switchState = 0;
   }
 }
 /*
   Turns off the relay and indicator light when scale reads value defined by the argument.
   The median value of 'n' readings is considered to avoid stray readings
+  The watchdog is enabled while filling, so a hang resets the board and turns off the relay
   INPUTS:
     Scale reading after which relay must turn off
   OUTPUTS:
@@ -135,52 +1037,79 @@ void loop() {
 */
 void control(long localVal) {
   long medianValue;
-  long temp = 0;
-  byte n = 3; // Enter the length of median array.Always use odd numbers
-  long medianArray[n];
+  byte n = medianWindow; // Length of median array, set by priming. Always odd
+  halWatchdog(true);
   if(localVal != -1){
+    long startValue = -1;
+    long lastValue = 0;
+    unsigned long lastTime = 0;
+    long predictGain = -1;    // Counts the predicted cut-off was ahead of the next median
+    stopLead = 0;
+    flowBegin(localVal);
     do {
-    for (byte m = 0; m < n; m++) {
-      //Log three readings into median array
-      medianArray[m] = -1 * scale.read();
-    }
-    //Re-arrange median array in ascending order
-    for (byte  s = 0; s < n - 1; s++) {
-      for (byte t = 0; t < n - s - 1; t++) {
-        if (medianArray[t] > medianArray[t + 1]) {
-          temp = medianArray[t];
-          medianArray[t] = medianArray[t + 1];
-          medianArray[t + 1] = temp;
-        }
-      }
+    halWatchdogReset();
+    medianValue = readMedian(n);
+    flowWeight(medianValue);
+    if (startValue == -1) {
+      startValue = medianValue;
+    }
+    //Liquid in the hose keeps arriving for hoseDelay after the relay turns off
+    else if (hoseDelay > 0 && medianTime != lastTime) {
+      long lead = (medianValue - lastValue) * hoseDelay / (long)(medianTime - lastTime);
+      stopLead = constrain((stopLead + lead) / 2, 0L, (long)MAX_OFFSET);
     }
-    for (byte x = 0; x < n; x++) {
-      Serial.print("Array ");
-      Serial.print(x);
-      Serial.print(":\t");
-      Serial.println(medianArray[x]);
+    //Turn the relay off between medians if the stop point will be crossed before the next one.
+    //The median belongs to the middle reading of its window, so time is taken from there
+    long rise = medianValue - lastValue;
+    long interval = medianTime - lastTime;
+    long remaining = localVal - medianValue - stopLead;
+    if (cutoffPredict && !cutoffFired && lastTime != 0) {
+      long due = predictCutoff(remaining, rise, interval, millis() - medianTime);
+      if (due != -1) {
+        scheduleCutoff(due);
+        predictGain = rise - remaining;
+      }
     }
-    //The median value is the (n+1)/2th term of the array
-    medianValue = medianArray[(n + 1) / 2];
-    Serial.print("Median : ");
+    lastValue = medianValue;
+    lastTime = medianTime;
+    printMsg(Serial, MSG_MEDIAN);
     Serial.print(medianValue);
-    Serial.print("\tDifference: ");
-    Serial.println(localVal - medianValue);
-    } while (localVal - medianValue > 0);     //If the scale reads less than threshold
+    printMsg(Serial, MSG_DIFFERENCE);
+    Serial.print(localVal - medianValue);
+    Serial.print(F("\tFlow: "));
+    Serial.println(flowMlPerS());
+    } while (localVal - medianValue - stopLead > 0 && machineFault == FAULT_NONE && !flowStopped && !cutoffFired);     //If the scale reads less than threshold
+    cancelCutoff();
+    flowEnd();
+    setRelay(false);
+    valveTune = machineFault == FAULT_NONE;
+    if (cutoffFired && predictGain >= 0) {
+      Serial.print(F("Sub-sample cut-off ahead of the next median by "));
+      Serial.print(predictGain);
+      Serial.println(F(" counts"));
+    }
+    if (machineFault == FAULT_NONE) {
+      doseLearn(modeIndex, localVal - startValue);
+    }
   }
   
   else{
-    lcd.clear();
-    lcd.setCursor(0,0);
-    lcd.print("Manual mode");
-    lcd.setCursor(0,1);
-    lcd.print("Dispensing");
-    while(digitalRead(DISPENSE) == 0){};
+    medianValue = manualFill();
   }
-  digitalWrite(LED_BUILTIN, LOW);
-  digitalWrite(RELAY_PIN, LOW);
+  setRelay(false);
+  halWatchdog(false);
+  if (machineFault == FAULT_NONE) {
+    countFill(localVal == -1 ? 3 : modeIndex);
+    if (localVal != -1) {
+      jobFillDone();
+    }
+  }
+  //Watch the scale after cut-off for a welded relay
+  relayOffTime = millis();
+  weldBaseline = medianValue;
+  weldState = 1;
   lcd.clear();
-  updateMode(index);
+  updateMode(modeIndex);
 }
 
 /*
@@ -191,19 +1120,64 @@ void control(long localVal) {
     Nil
 */
 void updateMode(int localIndex) {
-  if(localIndex == 3){
+  if (localIndex == CHECKWEIGH_INDEX) {
+    lcd.setCursor(0, 0);
+    lcd.print(F("Checkweigh      "));
+    lcd.setCursor(0, 1);
+    printMsg(lcd, MSG_PRESS_CHANGE);
+  }
+  else if (localIndex == RECIPE_INDEX) {
+    lcd.setCursor(0, 0);
+    lcd.print(F("Recipe          "));
+    lcd.setCursor(0, 1);
+    printMsg(lcd, MSG_PRESS_CHANGE);
+  }
+  else if (localIndex == JOB_INDEX) {
+    lcd.setCursor(0, 0);
+    lcd.print(F("Batch jobs      "));
+    lcd.setCursor(0, 1);
+    printMsg(lcd, MSG_PRESS_CHANGE);
+  }
+  else if (localIndex == PRIME_INDEX) {
+    lcd.setCursor(0, 0);
+    lcd.print(F("Prime pump      "));
+    lcd.setCursor(0, 1);
+    printMsg(lcd, MSG_PRESS_CHANGE);
+  }
+  else if(localIndex == 3){
     lcd.setCursor(0,0);
-    lcd.print("Manual Mode     ");
+    printMsg(lcd, MSG_MANUAL);
     lcd.setCursor(0,1);
-    lcd.print("Press to Change");
+    printMsg(lcd, MSG_PRESS_CHANGE);
   }
   else{
     lcd.setCursor(0, 0);
-    lcd.print("Volume: ");
+    printMsg(lcd, MSG_VOLUME);
     lcd.print(VOLUME[localIndex]);
-    lcd.print("  mL      ");
+    printMsg(lcd, MSG_ML);
     lcd.setCursor(0, 1);
-    lcd.print("Press to change");
+    if (jobRunning) {
+      lcd.print(F("Job "));
+      lcd.print(jobDone);
+      lcd.print('/');
+      lcd.print(jobCount[0]);
+      lcd.print(F(" Q:"));
+      lcd.print(jobLength);
+      lcd.print(F("     "));
+    }
+    else if (spcAlarm[localIndex]) {
+      lcd.print(F("SPC alarm "));
+      lcd.print(spcEwma[localIndex] / 16);
+      lcd.print(F("     "));
+    }
+    else if (relayCycles >= RELAY_LIFE / 100 * RELAY_WARN) {
+      lcd.print(F("Relay wear: "));
+      lcd.print(relayCycles / (RELAY_LIFE / 100));
+      lcd.print(F("% "));
+    }
+    else {
+      printMsg(lcd, MSG_PRESS_CHANGE);
+    }
   }
   
 }
@@ -217,50 +1191,63 @@ void updateMode(int localIndex) {
 */
 void calibrateFunction(int localIndex) {
   long localValue = val[localIndex];
+  long localTare;
   int flag = 0;
   lcd.setCursor(0, 0);
-  lcd.print("Begin Calibration");
+  printMsg(lcd, MSG_BEGIN_CAL);
   lcd.setCursor(0, 1);
-  lcd.print("Volume: ");
+  printMsg(lcd, MSG_VOLUME);
   lcd.print(VOLUME[localIndex]);
   delay(2000);
   lcd.clear();
-  lcd.println("Place container   ");
+  lcd.print(F("Empty platform   "));
+  delay(2000);
+  zeroOffset = 0;
+  scaleZero = readAverage(10);
+  lcd.clear();
+  printMsg(lcd, MSG_PLACE);
   delay(2000);
   lcd.clear();
-  lcd.print("Press VOL button   ");
+  printMsg(lcd, MSG_PRESS_VOL);
   lcd.setCursor(0, 1);
-  lcd.print("to fill     ");
+  printMsg(lcd, MSG_TO_FILL);
   delay(2000);
   lcd.clear();
   lcd.setCursor(0, 0);
-  lcd.print("Release    ");
+  printMsg(lcd, MSG_RELEASE);
   lcd.setCursor(0, 1);
-  lcd.print("to save value  ");
+  printMsg(lcd, MSG_TO_SAVE);
   delay(2000);
-  while (flag == 0) {
-    while (digitalRead(MODE) == 0) {
-      digitalWrite(LED_BUILTIN, HIGH);
-      digitalWrite(RELAY_PIN, HIGH);
-      localValue = scale.get_units(5) * -1;
+  localTare = readAverage(5);
+  while (flag == 0 && machineFault == FAULT_NONE) {
+    while (halButton(MODE) == 0 && machineFault == FAULT_NONE) {
+      setRelay(true);
+      localValue = readAverage(5);
       Serial.println(localValue);
       if (flag == 0) {
         flag = 1;
       }
     }
-    digitalWrite(LED_BUILTIN, LOW);
-    digitalWrite(RELAY_PIN, LOW);
+    setRelay(false);
+  }
+  //Do not save a value recorded from a faulty scale
+  if (machineFault != FAULT_NONE) {
+    return;
   }
   lcd.clear();
-  lcd.print("Done");
+  printMsg(lcd, MSG_DONE);
   lcd.setCursor(0, 1);
-  lcd.print("Saved: ");
+  printMsg(lcd, MSG_SAVED);
   lcd.print(localValue);
-  Serial.print("Value saved is: ");
+  printMsg(Serial, MSG_VALUE_SAVED);
   Serial.println(localValue);
   delay(2500);
   lcd.clear();
   EEPROMWrite(address[localIndex], localValue);
+  spcReset(localIndex);
+  EEPROMWrite(tareAddress[localIndex], localTare);
+  EEPROMWrite(tempAddress[localIndex], tempValid ? temperature : -1);
+  EEPROMWrite(ZERO_ADDRESS, scaleZero);
   //return localValue;
 }
 /*
@@ -278,10 +1265,12 @@ void EEPROMWrite(int address, long value) {
   byte two = ((value >> 16) & 0xFF);
   byte one = ((value >> 24) & 0xFF);
 
-  EEPROM.write(address, four);
-  EEPROM.write(address + 1, three);
-  EEPROM.write(address + 2, two);
-  EEPROM.write(address + 3, one);
+  //halStorageWrite() only writes bytes that changed, which saves EEPROM wear
+  halStorageWrite(address, four);
+  halStorageWrite(address + 1, three);
+  halStorageWrite(address + 2, two);
+  halStorageWrite(address + 3, one);
+  halStorageCommit();
 }
 /*
   Reads the value of long datatype at EEPROM location whose address is defined by the argument
@@ -300,40 +1289,54 @@ long EEPROMRead(long address) {
   return ((four << 0) & 0xFF) + ((three << 8) & 0xFFFF) + ((two << 16) & 0xFFFFFF) + ((one << 24) & 0xFFFFFFFF);
 }
 /*
-  Select the mode which should be calibrated
+  Select the mode which should be calibrated, checkweighed or queued
   INPUTS:
-    Nil
+    True to select for calibration, which also offers linearization
+    Heading shown on the LCD when not selecting for calibration
   OUTPUTS:
     The mode which should be calibrated
 */
-int selection() {
+int selection(bool calibration, const __FlashStringHelper *heading) {
   int selectionFlag = 0;
   int selectionIndex = 0;
   byte localSwitchState = 0;
   lcd.clear();
   lcd.setCursor(0, 0);
-  lcd.print("Entering Calib");
-  while (digitalRead(DISPENSE) == 0 || digitalRead(MODE) == 0) {};
+  if (calibration) {
+    printMsg(lcd, MSG_ENTERING_CAL);
+  }
+  else {
+    lcd.print(heading);
+  }
+  while (halButton(DISPENSE) == 0 || halButton(MODE) == 0) {};
   lcd.setCursor(0, 1);
-  lcd.print("Choose Volume");
+  printMsg(lcd, MSG_CHOOSE);
   delay(2000);
   lcd.clear();
   lcd.setCursor(0, 0);
-  lcd.print("Press DISPENSE ");
+  printMsg(lcd, MSG_PRESS_DISPENSE);
   lcd.setCursor(0, 1);
-  lcd.print("to confirm ");
+  printMsg(lcd, MSG_TO_CONFIRM);
   delay(2000);
   updateMode(selectionIndex);
   while (selectionFlag == 0) {
     localSwitchState = DebounceSwitch();
-    if (digitalRead(DISPENSE) == 0) {
+    if (halButton(DISPENSE) == 0) {
       selectionFlag = 1;
     }
-    updateMode(selectionIndex);
+    if (selectionIndex == 3) {
+      lcd.setCursor(0, 0);
+      lcd.print(F("Linearize scale "));
+      lcd.setCursor(0, 1);
+      printMsg(lcd, MSG_PRESS_CHANGE);
+    }
+    else {
+      updateMode(selectionIndex);
+    }
     if (localSwitchState == 1) {
       //delay(15);
       selectionIndex++;
-      if (selectionIndex > 2) {
+      if (selectionIndex > (calibration ? 3 : 2)) {
         selectionIndex = 0;
       }
     }
@@ -356,50 +1359,132 @@ void inspectContents() {
   byte inspectSwitchState = 0;
   lcd.clear();
   lcd.setCursor(0, 0);
-  lcd.print("Inspect Contents ");
+  printMsg(lcd, MSG_INSPECT);
   delay(2000);
   lcd.setCursor(0, 0);
-  lcd.print("Use VOL button   ");
+  printMsg(lcd, MSG_USE_VOL);
   lcd.setCursor(0, 1);
-  lcd.print("to toggle");
+  printMsg(lcd, MSG_TO_TOGGLE);
   delay(2000);
   lcd.clear();
   lcd.setCursor(0, 0);
-  lcd.print("Use DISP button");
+  printMsg(lcd, MSG_USE_DISP);
   lcd.setCursor(0, 1);
-  lcd.print("to exit");
+  printMsg(lcd, MSG_TO_EXIT);
   delay(2000);
   lcd.clear();
   while (inspectFlag == 0) {
+    loopTiming();
+    if (halScaleReady()) {
+      diagSample(readScale());
+    }
+    diagPublish();
     inspectSwitchState = DebounceSwitch();
     if (inspectSwitchState == 1) {
       inspectIndex++;
-      if (inspectIndex > 3) {
+      if (inspectIndex >= INSPECT_PAGES) {
         inspectIndex = 0;
       }
     }
     if (inspectIndex < 3) {
       lcd.setCursor(0, 0);
-      lcd.print("VOLUME: ");
+      printMsg(lcd, MSG_VOLUME_CAPS);
       lcd.print(VOLUME[inspectIndex]);
-      lcd.print("         ");
+      lcd.print(F("         "));
       lcd.setCursor(0, 1);
       lcd.print(val[inspectIndex]);
-      lcd.print("     ");
+      lcd.print(F("     "));
     }
-    else {
+    else if (inspectIndex == 3) {
       lcd.setCursor(0, 0);
-      lcd.print("Current val:     ");
+      printMsg(lcd, MSG_CURRENT);
       lcd.setCursor(0, 1);
-      lcd.print(scale.read() * -1);
-      lcd.print("        ");
+      lcd.print(readScale());
+      lcd.print(F("        "));
     }
-    if (digitalRead(DISPENSE) == 0) {
-      lcd.clear();
+    else if (inspectIndex == 6 || inspectIndex == 7) {
+      //Totals, or statistics of the current shift
+      long localBottles = bottles[0] + bottles[1] + bottles[2] + bottles[3];
+      long localMl = totalMl;
+      long localMinutes = runMinutes;
+      if (inspectIndex == 7) {
+        localBottles -= shiftBottles[0] + shiftBottles[1] + shiftBottles[2] + shiftBottles[3];
+        localMl -= shiftMl;
+        localMinutes -= shiftMinutes;
+      }
+      lcd.setCursor(0, 0);
+      lcd.print(inspectIndex == 6 ? F("Total: ") : F("Shift: "));
+      lcd.print(localBottles);
+      lcd.print(F(" btl      "));
+      lcd.setCursor(0, 1);
+      lcd.print(localMl / 1000);
+      lcd.print(F(" L  "));
+      lcd.print(localMinutes / 60);
+      lcd.print(F(" h        "));
+    }
+    else if (inspectIndex == 8) {
+      //Readings over the last DIAG_WINDOW
+      lcd.setCursor(0, 0);
+      printMsg(lcd, MSG_SPS);
+      lcd.print(diagRate / 10);
+      lcd.print('.');
+      lcd.print(diagRate % 10);
+      printMsg(lcd, MSG_SD);
+      lcd.print(diagSd);
+      lcd.print(F("       "));
+      lcd.setCursor(0, 1);
+      lcd.print(diagLow);
+      lcd.print(' ');
+      lcd.print(diagHigh);
+      lcd.print(F("        "));
+    }
+    else if (inspectIndex == 9) {
+      lcd.setCursor(0, 0);
+      printMsg(lcd, MSG_ZERO_OFF);
+      lcd.print(zeroOffset);
+      lcd.print(F("      "));
+      lcd.setCursor(0, 1);
+      printMsg(lcd, MSG_LOOP);
+      lcd.print(loopPeriod / 1000);
+      printMsg(lcd, MSG_LOOP_MAX);
+      lcd.print(loopWorst / 1000);
+      printMsg(lcd, MSG_LOOP_MS);
+    }
+    else if (inspectIndex == 5) {
+      lcd.setCursor(0, 0);
+      lcd.print(F("Relay cycles:   "));
+      lcd.setCursor(0, 1);
+      lcd.print(relayCycles);
+      lcd.print(F("          "));
+    }
+    else if (inspectIndex == 4) {
       lcd.setCursor(0, 0);
-      lcd.print("Exiting...");
-      delay(500);
-      inspectFlag = 1;
+      lcd.print(F("Zero offset:    "));
+      lcd.setCursor(0, 1);
+      lcd.print(zeroOffset);
+      lcd.print(F(" Crp:"));
+      lcd.print(creepQ16 >> 16);
+      lcd.print(F("     "));
+    }
+    if (halButton(DISPENSE) == 0) {
+      //Holding DISPENSE on the shift page starts a new shift instead of exiting
+      unsigned long pressTime = millis();
+      while (inspectIndex == 7 && halButton(DISPENSE) == 0 && millis() - pressTime < 2000) {};
+      if (inspectIndex == 7 && halButton(DISPENSE) == 0) {
+        resetShift();
+        lcd.clear();
+        lcd.print(F("Shift reset"));
+        while (halButton(DISPENSE) == 0) {};
+        delay(500);
+        lcd.clear();
+      }
+      else {
+        lcd.clear();
+        lcd.setCursor(0, 0);
+        printMsg(lcd, MSG_EXITING);
+        delay(500);
+        inspectFlag = 1;
+      }
     }
     inspectSwitchState = 0;
   }
@@ -410,9 +1495,3482 @@ void inspectContents() {
 //Method found in https://my.eng.utah.edu/%7Ecs5780/debouncing.pdf
 byte DebounceSwitch() {
   static uint16_t State = 0; // Current debounce status
-  State = (State << 1) | !digitalRead(MODE) | 0xe000;
+  State = (State << 1) | !halButton(MODE) | 0xe000;
   if (State == 0xf000)return 1;
   return 0;
 }
 
+/*
+  Reads the load cell and corrects the reading for zero and span drift with temperature,
+  nonlinearity, tracked zero drift and creep.
+  Every scale reading should be taken through this function.
+  INPUTS:
+    Nil
+  OUTPUTS:
+    Scale reading corrected to TEMP_REF
+*/
+long readScale() {
+  updateTemperature();
+  long raw = readRaw() * -1;
+  long reading = linearize(raw - tcOffset - (((raw - scaleZero) * tcSpan) >> 16) - zeroOffset);
+  //Creep approaches CREEP_PPM of the load with time constant CREEP_TAU and recovers the same way
+  creepQ16 += ((reading - scaleZero) * (CREEP_PPM * 65536L / 1000000) - creepQ16) / CREEP_TAU;
+  scaleReading = reading - (creepQ16 >> 16);
+  return scaleReading;
+}
+
+/*
+  Average of several corrected scale readings
+  INPUTS:
+    Number of readings to average
+  OUTPUTS:
+    Average scale reading
+*/
+long readAverage(byte times) {
+  long sum = 0;
+  for (byte i = 0; i < times; i++) {
+    sum += readScale();
+  }
+  return sum / times;
+}
+
+/*
+  Reads the thermistor once every TEMP_INTERVAL ms and precomputes the zero and span corrections
+  so that readScale() only needs one multiplication per reading.
+  INPUTS:
+    Nil
+  OUTPUTS:
+    Nil
+*/
+void updateTemperature() {
+  static unsigned long lastUpdate = 0;
+  static bool started = false;
+  static int filteredAdc = 0;
+  if (started && millis() - lastUpdate < TEMP_INTERVAL) {
+    return;
+  }
+  started = true;
+  lastUpdate = millis();
+  int adc = analogRead(THERMISTOR_PIN);
+  //Readings near the rails mean the thermistor is open or shorted
+  if (adc < 16 || adc > 1007) {
+    tempValid = false;
+    tcOffset = 0;
+    tcSpan = 0;
+    return;
+  }
+  if (!tempValid) {
+    filteredAdc = adc;
+    tempValid = true;
+  }
+  filteredAdc += (adc - filteredAdc) / 4;
+  temperature = lookupTemperature(filteredAdc);
+  int dT = temperature - TEMP_REF;
+  tcOffset = (long)TC_ZERO * dT / 10;
+  //ppm per degC * 0.1 degC to Q16: x * 65536 / 10000000 = x * 8192 / 1250000
+  tcSpan = (long)TC_SPAN * dT * 8192 / 1250000;
+}
+
+/*
+  Converts a thermistor ADC reading to temperature by interpolating THERMISTOR_TABLE
+  INPUTS:
+    ADC reading (0 - 1023)
+  OUTPUTS:
+    Temperature in 0.1 degC
+*/
+int lookupTemperature(int adc) {
+  byte i = adc >> 5;
+  int t0 = pgm_read_word(&THERMISTOR_TABLE[i]);
+  int t1 = pgm_read_word(&THERMISTOR_TABLE[i + 1]);
+  return t0 + (int)(((long)(t1 - t0) * (adc & 31)) >> 5);
+}
+
+/*
+  Density of the liquid relative to 20 degC by interpolating DENSITY_TABLE
+  INPUTS:
+    Temperature in 0.1 degC
+  OUTPUTS:
+    Density deviation in ppm
+*/
+int densityPpm(int localTemp) {
+  localTemp = constrain(localTemp, 0, 499);
+  byte i = localTemp / 50;
+  int d0 = pgm_read_word(&DENSITY_TABLE[i]);
+  int d1 = pgm_read_word(&DENSITY_TABLE[i + 1]);
+  return d0 + (int)((long)(d1 - d0) * (localTemp % 50) / 50);
+}
+
+/*
+  Threshold of a mode corrected for the density of the liquid at the current temperature, so that
+  the dispensed volume stays the same as the volume during calibration
+  INPUTS:
+    Index of the mode
+  OUTPUTS:
+    Scale reading after which relay must turn off
+*/
+long fillThreshold(int localIndex) {
+  long threshold = val[localIndex];
+  if (localIndex > 2 || threshold == -1 || calTare[localIndex] == -1 || calTemp[localIndex] == -1 || !tempValid) {
+    return threshold;
+  }
+  long net = threshold - calTare[localIndex];
+  if (net <= 0) {
+    return threshold;
+  }
+  return threshold + (net / 100) * (densityPpm(temperature) - densityPpm(calTemp[localIndex])) / 10000;
+}
+
+/*
+  Corrects the nonlinearity of the load cell by interpolating the linearization table.
+  Readings outside the table get the correction of the nearest end point.
+  INPUTS:
+    Temperature corrected scale reading
+  OUTPUTS:
+    Linearized scale reading
+*/
+long linearize(long reading) {
+  if (!linValid) {
+    return reading;
+  }
+  long x = reading - scaleZero;
+  if (x <= 0) {
+    return reading + linCorr[0];
+  }
+  if (x >= linRaw[LIN_POINTS - 1]) {
+    return reading + linCorr[LIN_POINTS - 1];
+  }
+  byte i = 0;
+  while (x >= linRaw[i + 1]) {
+    i++;
+  }
+  return reading + linCorr[i] + (((x - linRaw[i]) * linSlope[i]) >> 16);
+}
+
+/*
+  Loads the linearization table from EEPROM and precomputes the slope of every segment.
+  The table is ignored if it was never recorded.
+  INPUTS:
+    Nil
+  OUTPUTS:
+    Nil
+*/
+void loadLinearization() {
+  linValid = false;
+  for (byte i = 0; i < LIN_POINTS; i++) {
+    linRaw[i] = EEPROMRead(LIN_ADDRESS + 8 * i);
+    linCorr[i] = EEPROMRead(LIN_ADDRESS + 8 * i + 4);
+  }
+  if (linRaw[0] != 0) {
+    return;
+  }
+  for (byte i = 0; i < LIN_POINTS - 1; i++) {
+    if (linRaw[i + 1] <= linRaw[i]) {
+      return;
+    }
+    linSlope[i] = ((linCorr[i + 1] - linCorr[i]) << 16) / (linRaw[i + 1] - linRaw[i]);
+  }
+  linSlope[LIN_POINTS - 1] = 0;
+  linValid = true;
+}
+
+/*
+  Records the scale reading at each reference mass in LIN_MASS[] and saves the deviation of each
+  point from the straight line through the first and last points. The deviation at each point is
+  reported on the LCD and Serial in 0.1 g; this is the error removed by the table.
+  INPUTS:
+    Nil
+  OUTPUTS:
+    Nil
+*/
+void linearizeFunction() {
+  long localRaw[LIN_POINTS];
+  linValid = false;
+  zeroOffset = 0;
+  lcd.clear();
+  lcd.print(F("Linearize scale"));
+  delay(2000);
+  while (halButton(DISPENSE) == 0) {};
+  for (byte i = 0; i < LIN_POINTS; i++) {
+    lcd.clear();
+    if (i == 0) {
+      lcd.print(F("Empty platform"));
+    }
+    else {
+      lcd.print(F("Place "));
+      lcd.print(LIN_MASS[i]);
+      lcd.print(F(" g"));
+    }
+    lcd.setCursor(0, 1);
+    lcd.print(F("Press DISPENSE"));
+    waitForDispense();
+    lcd.setCursor(0, 1);
+    lcd.print(F("Reading...     "));
+    delay(1000);
+    localRaw[i] = readAverage(10);
+    if (machineFault != FAULT_NONE) {
+      loadLinearization();
+      return;
+    }
+    Serial.print(F("Point "));
+    Serial.print(LIN_MASS[i]);
+    Serial.print(F(" g: "));
+    Serial.println(localRaw[i]);
+  }
+  long span = localRaw[LIN_POINTS - 1] - localRaw[0];
+  for (byte i = 0; i < LIN_POINTS - 1; i++) {
+    if (localRaw[i + 1] <= localRaw[i]) {
+      lcd.clear();
+      lcd.print(F("Failed. Check"));
+      lcd.setCursor(0, 1);
+      lcd.print(F("reference masses"));
+      Serial.println(F("Linearization failed, readings not increasing"));
+      delay(2500);
+      lcd.clear();
+      loadLinearization();
+      return;
+    }
+  }
+  scaleZero = localRaw[0];
+  EEPROMWrite(ZERO_ADDRESS, scaleZero);
+  for (byte i = 0; i < LIN_POINTS; i++) {
+    long offset = localRaw[i] - localRaw[0];
+    long correction = span * LIN_MASS[i] / LIN_MASS[LIN_POINTS - 1] - offset;
+    EEPROMWrite(LIN_ADDRESS + 8 * i, offset);
+    EEPROMWrite(LIN_ADDRESS + 8 * i + 4, correction);
+    long error = correction * 10 * LIN_MASS[LIN_POINTS - 1] / span;
+    Serial.print(F("Nonlinearity removed at "));
+    Serial.print(LIN_MASS[i]);
+    Serial.print(F(" g (0.1 g): "));
+    Serial.println(error);
+    lcd.clear();
+    lcd.print(LIN_MASS[i]);
+    lcd.print(F(" g"));
+    lcd.setCursor(0, 1);
+    lcd.print(F("Corr: "));
+    if (error < 0) {
+      lcd.print('-');
+      error = -error;
+    }
+    lcd.print(error / 10);
+    lcd.print('.');
+    lcd.print(error % 10);
+    lcd.print(F(" g"));
+    delay(1500);
+  }
+  loadLinearization();
+  lcd.clear();
+  printMsg(lcd, MSG_DONE);
+  lcd.setCursor(0, 1);
+  lcd.print(F("Recalibrate modes"));
+  delay(2500);
+  lcd.clear();
+}
+
+/*
+  Waits until the DISPENSE button is pressed and released
+  INPUTS:
+    Nil
+  OUTPUTS:
+    Nil
+*/
+void waitForDispense() {
+  while (halButton(DISPENSE) == 1) {};
+  delay(50);
+  while (halButton(DISPENSE) == 0) {};
+  delay(50);
+}
+
+/*
+  Slowly follows the drift of the empty platform reading. The zero is only tracked when the
+  platform is stable and within ZERO_BAND of zero, so a placed container is never tracked out.
+  INPUTS:
+    Current scale reading
+  OUTPUTS:
+    Nil
+*/
+void trackZero(long reading) {
+  bool stable = updateStable(reading);
+  long error = reading - scaleZero;
+  if (scaleZero == -1 || !stable || labs(error) > ZERO_BAND) {
+    return;
+  }
+  if (error > 0) {
+    zeroOffset += error / 16 + 1;
+  }
+  else if (error < 0) {
+    zeroOffset += error / 16 - 1;
+  }
+  zeroOffset = constrain(zeroOffset, -ZERO_LIMIT, ZERO_LIMIT);
+}
+
+/*
+  Reads the HX711 without blocking forever and checks the reading for plausibility.
+  A healthy reading is returned as soon as it is ready. On a fault the relay is turned off,
+  the fault is latched and the last good reading is returned.
+  INPUTS:
+    Nil
+  OUTPUTS:
+    Raw HX711 reading
+*/
+long readRaw() {
+  static long lastRaw = 0;
+  static bool started = false;
+  static byte jumpCount = 0;
+  static byte stuckCount = 0;
+  if (machineFault != FAULT_NONE) {
+    return lastRaw;
+  }
+  unsigned long start = millis();
+  while (!halScaleReady()) {
+    flowCheck();
+    cutoffCheck();
+    updateValve();
+    if (millis() - start > HX711_TIMEOUT) {
+      blackBoxEvent(BB_TIMEOUT, 0);
+      setFault(FAULT_TIMEOUT);
+      return lastRaw;
+    }
+  }
+  long raw = halScaleRead();
+  blackBoxSample(raw);
+  if (raw >= 0x7FFFFFL || raw <= -0x800000L) {
+    setFault(FAULT_SATURATED);
+    return lastRaw;
+  }
+  if (started && raw == lastRaw) {
+    if (++stuckCount >= STUCK_COUNT) {
+      setFault(FAULT_STUCK);
+    }
+    return lastRaw;
+  }
+  stuckCount = 0;
+  //Discard a single glitch, but latch a fault if the reading keeps jumping
+  if (started && labs(raw - lastRaw) > MAX_STEP) {
+    if (++jumpCount >= MAX_JUMPS) {
+      setFault(FAULT_JUMP);
+    }
+    return lastRaw;
+  }
+  jumpCount = 0;
+  started = true;
+  lastRaw = raw;
+  return raw;
+}
+
+/*
+  Turns off the relay and latches a fault
+  INPUTS:
+    Fault code
+  OUTPUTS:
+    Nil
+*/
+void setFault(byte fault) {
+  for (byte i = 0; i < INGREDIENTS; i++) {
+    setPump(i, false);
+  }
+  digitalWrite(VALVE_PIN, LOW);
+  valveState = 0;
+  machineFault = fault;
+  Serial.print(F("Fault: "));
+  Serial.println(fault);
+  blackBoxEvent(BB_FAULT, fault);
+  saveBlackBox(fault);
+}
+
+/*
+  Displays the latched fault and its reason
+  INPUTS:
+    Nil
+  OUTPUTS:
+    Nil
+*/
+void showFault() {
+  static byte shownFault = FAULT_NONE;
+  static byte shownIndex = 255;
+  digitalWrite(RELAY_PIN, LOW);
+  if (shownFault == machineFault && shownIndex == modeIndex) {
+    return;
+  }
+  shownFault = machineFault;
+  shownIndex = modeIndex;
+  lcd.clear();
+  lcd.setCursor(0, 0);
+  if (machineFault == FAULT_WELDED) {
+    lcd.print(F("RELAY WELDED"));
+    lcd.setCursor(0, 1);
+    lcd.print(F("Cut pump power"));
+    return;
+  }
+  if (modeIndex < 3 && doseRate[modeIndex] > 0) {
+    lcd.print(F("TIMED "));
+    lcd.print(VOLUME[modeIndex]);
+    lcd.print(F(" mL"));
+  }
+  else {
+    lcd.print(F("SCALE FAULT"));
+  }
+  lcd.setCursor(0, 1);
+  switch (machineFault) {
+    case FAULT_TIMEOUT:
+      lcd.print(F("No data (DOUT)"));
+      break;
+    case FAULT_SATURATED:
+      lcd.print(F("Load cell open"));
+      break;
+    case FAULT_STUCK:
+      lcd.print(F("Reading stuck"));
+      break;
+    default:
+      lcd.print(F("Reading jumps"));
+      break;
+  }
+}
+
+/*
+  Turns the pump relay and indicator light on or off. Every off to on transition is counted
+  as a relay cycle and saved to EEPROM.
+  INPUTS:
+    True to turn the relay on
+  OUTPUTS:
+    Nil
+*/
+void setRelay(bool on) {
+  digitalWrite(LED_BUILTIN, on ? HIGH : LOW);
+  digitalWrite(RELAY_PIN, on ? HIGH : LOW);
+  if (on != relayState) {
+    blackBoxEvent(on ? BB_RELAY_ON : BB_RELAY_OFF, 0);
+    bitWrite(bbPumps, 0, on);
+  }
+  if (!on && relayState) {
+    relayRunTime = (cutoffFired ? cutoffTime : millis()) - relayOnTime;
+    valveState = 1;
+    updateValve();
+  }
+  if (on && !relayState) {
+    digitalWrite(VALVE_PIN, HIGH);
+    valveState = 0;
+    valveTune = false;
+    cutoffFired = false;
+    relayOnTime = millis();
+    relayCycles++;
+    ringWrite(RELAY_ADDRESS, RELAY_SLOTS, relayCycles);
+    if (relayCycles == RELAY_LIFE / 100 * RELAY_WARN) {
+      Serial.println(F("Relay approaching rated life"));
+    }
+  }
+  relayState = on;
+}
+
+/*
+  Checks that the mass stops rising after the relay is turned off. Once drips have had DRIP_TIME
+  to stop, a rise of more than WELD_RISE within WELD_WINDOW means the relay contacts are welded
+  and the pump is still running. The check is dropped if the container is removed.
+  INPUTS:
+    Current scale reading
+  OUTPUTS:
+    Nil
+*/
+void checkWeld(long reading) {
+  if (weldState == 0) {
+    return;
+  }
+  unsigned long elapsed = millis() - relayOffTime;
+  if (weldState == 1) {
+    if (elapsed >= DRIP_TIME) {
+      weldBaseline = reading;
+      weldState = 2;
+      spcResult(reading);
+    }
+    return;
+  }
+  if (reading < weldBaseline - ZERO_BAND) {
+    weldState = 0;
+  }
+  else if (reading - weldBaseline > WELD_RISE) {
+    weldState = 0;
+    setFault(FAULT_WELDED);
+  }
+  else if (elapsed >= DRIP_TIME + WELD_WINDOW) {
+    weldState = 0;
+  }
+}
+
+/*
+  Reads a wear leveled counter. The counter is written to slot (value % slots), so the newest
+  value is the largest one in the ring. Erased slots read as -1 and are ignored.
+  INPUTS:
+    EEPROM location of the ring
+    Number of 4 byte slots in the ring
+  OUTPUTS:
+    Counter value, 0 if the ring is empty
+*/
+long ringRead(int base, byte slots) {
+  long value = 0;
+  for (byte i = 0; i < slots; i++) {
+    long slotValue = EEPROMRead(base + 4 * i);
+    if (slotValue > value) {
+      value = slotValue;
+    }
+  }
+  return value;
+}
+
+/*
+  Writes a wear leveled counter to its slot in the ring
+  INPUTS:
+    EEPROM location of the ring
+    Number of 4 byte slots in the ring
+    Counter value
+  OUTPUTS:
+    Nil
+*/
+void ringWrite(int base, byte slots, long value) {
+  EEPROMWrite(base + 4 * (value % slots), value);
+}
+
+/*
+  Loads the newest production counter record from the ring, and the counters at the start of
+  the shift. The newest record is the one with the largest sequence number.
+  INPUTS:
+    Nil
+  OUTPUTS:
+    Nil
+*/
+void loadCounters() {
+  int newest = -1;
+  counterSeq = 0;
+  for (byte i = 0; i < COUNTER_SLOTS; i++) {
+    long seq = EEPROMRead(COUNTER_ADDRESS + COUNTER_SIZE * i);
+    if (seq != -1 && seq >= counterSeq) {
+      counterSeq = seq;
+      newest = COUNTER_ADDRESS + COUNTER_SIZE * i;
+    }
+  }
+  if (newest == -1) {
+    return;
+  }
+  for (byte i = 0; i < 4; i++) {
+    bottles[i] = EEPROMRead(newest + 4 + 4 * i);
+    shiftBottles[i] = EEPROMRead(SHIFT_ADDRESS + 4 * i);
+  }
+  totalMl = EEPROMRead(newest + 20);
+  runMinutes = EEPROMRead(newest + 24);
+  shiftMl = EEPROMRead(SHIFT_ADDRESS + 16);
+  shiftMinutes = EEPROMRead(SHIFT_ADDRESS + 20);
+  //No shift was started yet
+  if (shiftMinutes == -1) {
+    resetShift();
+  }
+}
+
+/*
+  Saves the production counters to the next record of the ring. The sequence number is
+  written last, so a record cut short by a power loss is never taken as the newest.
+  INPUTS:
+    Nil
+  OUTPUTS:
+    Nil
+*/
+void saveCounters() {
+  counterSeq++;
+  int record = COUNTER_ADDRESS + COUNTER_SIZE * (counterSeq % COUNTER_SLOTS);
+  for (byte i = 0; i < 4; i++) {
+    EEPROMWrite(record + 4 + 4 * i, bottles[i]);
+  }
+  EEPROMWrite(record + 20, totalMl);
+  EEPROMWrite(record + 24, runMinutes);
+  EEPROMWrite(record, counterSeq);
+}
+
+/*
+  Counts a completed fill
+  INPUTS:
+    Index of the mode, 3 for manual mode
+  OUTPUTS:
+    Nil
+*/
+void countFill(byte localIndex) {
+  bottles[localIndex]++;
+  if (localIndex < 3) {
+    totalMl += VOLUME[localIndex];
+  }
+  saveCounters();
+}
+
+/*
+  Counts the minutes the machine is switched on and saves them every RUNTIME_SAVE minutes
+  INPUTS:
+    Nil
+  OUTPUTS:
+    Nil
+*/
+void updateRuntime() {
+  static unsigned long lastMinute = 0;
+  if (millis() - lastMinute < 60000) {
+    return;
+  }
+  lastMinute += 60000;
+  runMinutes++;
+  if (runMinutes % RUNTIME_SAVE == 0) {
+    saveCounters();
+  }
+}
+
+/*
+  Starts a new shift by saving the current counters as the start of the shift
+  INPUTS:
+    Nil
+  OUTPUTS:
+    Nil
+*/
+void resetShift() {
+  for (byte i = 0; i < 4; i++) {
+    shiftBottles[i] = bottles[i];
+    EEPROMWrite(SHIFT_ADDRESS + 4 * i, shiftBottles[i]);
+  }
+  shiftMl = totalMl;
+  shiftMinutes = runMinutes;
+  EEPROMWrite(SHIFT_ADDRESS + 16, shiftMl);
+  EEPROMWrite(SHIFT_ADDRESS + 20, shiftMinutes);
+  Serial.println(F("Shift reset"));
+}
+
+/*
+  Prints the production counters and statistics of the current shift to Serial
+  INPUTS:
+    Nil
+  OUTPUTS:
+    Nil
+*/
+void printStats() {
+  Serial.println(F("Mode\tTotal\tShift"));
+  for (byte i = 0; i < 4; i++) {
+    if (i < 3) {
+      Serial.print(VOLUME[i]);
+      Serial.print(F(" mL"));
+    }
+    else {
+      Serial.print(F("Manual"));
+    }
+    Serial.print('\t');
+    Serial.print(bottles[i]);
+    Serial.print('\t');
+    Serial.println(bottles[i] - shiftBottles[i]);
+  }
+  Serial.print(F("Volume mL\t"));
+  Serial.print(totalMl);
+  Serial.print('\t');
+  Serial.println(totalMl - shiftMl);
+  Serial.print(F("Runtime min\t"));
+  Serial.print(runMinutes);
+  Serial.print('\t');
+  Serial.println(runMinutes - shiftMinutes);
+}
+
+/*
+  Collects characters from Serial into a line and runs the command when the line ends
+  INPUTS:
+    Nil
+  OUTPUTS:
+    Nil
+*/
+void serialCommands() {
+  static char line[24];
+  static byte length = 0;
+  while (Serial.available() > 0) {
+    char c = Serial.read();
+    if (c == '\r') {
+      continue;
+    }
+    if (c != '\n') {
+      if (length < sizeof(line) - 1) {
+        line[length++] = c;
+      }
+      continue;
+    }
+    line[length] = 0;
+    length = 0;
+    //Commands are left out of the loop time, some of them block on purpose
+    loopLast = 0;
+    if (strcmp_P(line, PSTR("STATS")) == 0) {
+      printStats();
+    }
+    else if (strcmp_P(line, PSTR("SHIFT RESET")) == 0) {
+      resetShift();
+    }
+    else if (strcmp_P(line, PSTR("BBOX")) == 0) {
+      printBlackBox(false);
+    }
+    else if (strcmp_P(line, PSTR("BBOX LIVE")) == 0) {
+      printBlackBox(true);
+    }
+    else if (strcmp_P(line, PSTR("CURVES")) == 0) {
+      printCurves();
+    }
+    else if (strcmp_P(line, PSTR("CURVE NEXT")) == 0) {
+      curveRequest = true;
+    }
+    else if (strcmp_P(line, PSTR("SPC")) == 0) {
+      printSpc();
+    }
+    else if (strcmp_P(line, PSTR("SPC RESET")) == 0) {
+      for (byte i = 0; i < 3; i++) {
+        spcReset(i);
+      }
+    }
+    else if (strcmp_P(line, PSTR("JOBS")) == 0) {
+      printJobs();
+    }
+    else if (strcmp_P(line, PSTR("FLOW")) == 0) {
+      printFlow();
+    }
+    else if (strcmp_P(line, PSTR("DOSE")) == 0) {
+      printDose();
+    }
+    else if (strcmp_P(line, PSTR("VALVE")) == 0) {
+      printValve();
+    }
+    else if (strcmp_P(line, PSTR("DIAG")) == 0) {
+      printDiag();
+    }
+    else if (strncmp_P(line, PSTR("TEACH "), 6) == 0) {
+      long mode = strtol(&line[6], NULL, 10);
+      if (mode < 1 || mode > 3 || !teachMode(mode - 1)) {
+        Serial.println(F("No manual fill to teach"));
+      }
+      updateMode(modeIndex);
+    }
+    else if (strcmp_P(line, PSTR("NOISE")) == 0) {
+      printNoise();
+    }
+    else if (strcmp_P(line, PSTR("NOISE RUN")) == 0) {
+      runNoise();
+    }
+    else if (strncmp_P(line, PSTR("FILTER "), 7) == 0) {
+      long window = strtol(&line[7], NULL, 10);
+      if (window >= 1 && window <= MEDIAN_MAX && window % 2 == 1) {
+        medianWindow = window;
+        EEPROMWrite(FILTER_ADDRESS, medianWindow);
+      }
+      printNoise();
+    }
+    else if (strcmp_P(line, PSTR("CONFIG EXPORT")) == 0) {
+      exportConfig();
+    }
+    else if (strcmp_P(line, PSTR("CONFIG IMPORT")) == 0) {
+      importConfig();
+    }
+    else if (strcmp_P(line, PSTR("MEM")) == 0) {
+      printMemory();
+    }
+    else if (strcmp_P(line, PSTR("BENCH")) == 0) {
+      runBench();
+    }
+    else if (strncmp_P(line, PSTR("PREDICT "), 8) == 0) {
+      cutoffPredict = strtol(&line[8], NULL, 10) == 1;
+      EEPROMWrite(PREDICT_ADDRESS, cutoffPredict);
+      Serial.print(F("Sub-sample cut-off "));
+      Serial.println(cutoffPredict ? F("on") : F("off"));
+    }
+    else if (strncmp_P(line, PSTR("VALVE "), 6) == 0) {
+      char *p = &line[6];
+      valveOffset = constrain(strtol(p, &p, 10), 0L, (long)VALVE_MAX);
+      valveAuto = strtol(p, &p, 10) != 0;
+      EEPROMWrite(VALVE_ADDRESS, valveOffset);
+      EEPROMWrite(VALVE_ADDRESS + 4, valveAuto);
+      printValve();
+    }
+    else if (strcmp_P(line, PSTR("JOB CLEAR")) == 0) {
+      jobLength = 0;
+      jobDone = 0;
+      jobRunning = false;
+      updateMode(modeIndex);
+      printJobs();
+    }
+    else if (strncmp_P(line, PSTR("JOB "), 4) == 0) {
+      char *p = &line[4];
+      long mode = strtol(p, &p, 10);
+      long count = strtol(p, &p, 10);
+      if (mode < 1 || mode > 3 || count < 1 || !addJob(mode - 1, count)) {
+        Serial.println(F("Job not queued"));
+      }
+      else {
+        jobRunning = true;
+        modeIndex = jobMode[0];
+        updateMode(modeIndex);
+        printJobs();
+      }
+    }
+    else if (strncmp_P(line, PSTR("SPC "), 4) == 0) {
+      char *p = &line[4];
+      spcEwmaLimit = strtol(p, &p, 10);
+      spcK = strtol(p, &p, 10);
+      spcH = strtol(p, &p, 10);
+      spcAutoAdjust = strtol(p, &p, 10) != 0;
+      EEPROMWrite(SPC_CONFIG, spcEwmaLimit);
+      EEPROMWrite(SPC_CONFIG + 4, spcK);
+      EEPROMWrite(SPC_CONFIG + 8, spcH);
+      EEPROMWrite(SPC_CONFIG + 12, spcAutoAdjust);
+      printSpc();
+    }
+    else {
+      Serial.print(F("Unknown command: "));
+      Serial.println(line);
+    }
+  }
+}
+
+/*
+  Starts the black box after a reset. If the RAM contents survived (watchdog or external reset)
+  and a pump was on when the board reset, the black box is saved to EEPROM before logging
+  continues. After a power up the ring is cleared.
+  INPUTS:
+    Reset flags from halResetCause()
+  OUTPUTS:
+    Nil
+*/
+void blackBoxBoot(byte resetCause) {
+  if (bbMagic != BB_MAGIC || bbHead < 0 || bbHead >= BB_SIZE || bbCount < 0 || bbCount > BB_SIZE) {
+    bbMagic = BB_MAGIC;
+    bbHead = 0;
+    bbCount = 0;
+    bbPumps = 0;
+  }
+  else if (bbPumps != 0) {
+    bbPumps = 0;
+    saveBlackBox(BB_RESET);
+    Serial.println(F("Reset while dispensing, black box saved"));
+  }
+  blackBoxEvent(BB_BOOT, resetCause);
+}
+
+/*
+  Logs a raw HX711 reading to the black box. The lowest bit is dropped to fit in 23 bits.
+  INPUTS:
+    Raw HX711 reading
+  OUTPUTS:
+    Nil
+*/
+void blackBoxSample(long raw) {
+  long entry = (raw >> 1) & 0x7FFFFFL;
+  byte *p = &bbRing[bbHead * 3];
+  p[0] = entry;
+  p[1] = entry >> 8;
+  p[2] = entry >> 16;
+  if (++bbHead >= BB_SIZE) {
+    bbHead = 0;
+  }
+  if (bbCount < BB_SIZE) {
+    bbCount++;
+  }
+}
+
+/*
+  Logs a state transition to the black box
+  INPUTS:
+    Event code (BB_...)
+    Event data
+  OUTPUTS:
+    Nil
+*/
+void blackBoxEvent(byte code, int data) {
+  byte *p = &bbRing[bbHead * 3];
+  p[0] = data;
+  p[1] = data >> 8;
+  p[2] = 0x80 | code;
+  if (++bbHead >= BB_SIZE) {
+    bbHead = 0;
+  }
+  if (bbCount < BB_SIZE) {
+    bbCount++;
+  }
+}
+
+/*
+  Copies the newest BB_SAVE entries of the black box to EEPROM, oldest first
+  INPUTS:
+    Reason for saving, fault code or BB_RESET
+  OUTPUTS:
+    Nil
+*/
+void saveBlackBox(byte reason) {
+  int count = min(bbCount, BB_SAVE);
+  int entry = bbHead - count;
+  if (entry < 0) {
+    entry += BB_SIZE;
+  }
+  for (int i = 0; i < count; i++) {
+    halWatchdogReset();
+    for (byte b = 0; b < 3; b++) {
+      halStorageWrite(BB_ADDRESS + 4 + 3 * i + b, bbRing[entry * 3 + b]);
+    }
+    if (++entry >= BB_SIZE) {
+      entry = 0;
+    }
+  }
+  halStorageWrite(BB_ADDRESS, reason);
+  halStorageWrite(BB_ADDRESS + 1, count);
+  halStorageCommit();
+}
+
+/*
+  Prints the black box to Serial, oldest entry first, one entry per line:
+    S <raw reading>     HX711 reading
+    E <code> <data>     Event
+  The output can be replayed through the sample pipeline on a PC.
+  INPUTS:
+    True to print the ring in RAM, false for the copy saved in EEPROM
+  OUTPUTS:
+    Nil
+*/
+void printBlackBox(bool live) {
+  int count;
+  int entry;
+  Serial.print(F("BB "));
+  if (live) {
+    count = bbCount;
+    entry = bbHead - count;
+    if (entry < 0) {
+      entry += BB_SIZE;
+    }
+    Serial.print(F("LIVE"));
+  }
+  else {
+    count = EEPROM.read(BB_ADDRESS + 1);
+    if (count > BB_SAVE) {
+      count = 0;
+    }
+    entry = 0;
+    Serial.print(EEPROM.read(BB_ADDRESS));
+  }
+  Serial.print(' ');
+  Serial.println(count);
+  for (int i = 0; i < count; i++) {
+    if (live) {
+      printBlackBoxEntry(bbRing[entry * 3], bbRing[entry * 3 + 1], bbRing[entry * 3 + 2]);
+      if (++entry >= BB_SIZE) {
+        entry = 0;
+      }
+    }
+    else {
+      int localAddress = BB_ADDRESS + 4 + 3 * i;
+      printBlackBoxEntry(EEPROM.read(localAddress), EEPROM.read(localAddress + 1), EEPROM.read(localAddress + 2));
+    }
+  }
+  Serial.println(F("BB END"));
+}
+
+/*
+  Decodes and prints one black box entry
+  INPUTS:
+    The three bytes of the entry, lowest first
+  OUTPUTS:
+    Nil
+*/
+void printBlackBoxEntry(byte b0, byte b1, byte b2) {
+  if (b2 & 0x80) {
+    Serial.print(F("E "));
+    Serial.print(b2 & 0x7F);
+    Serial.print(' ');
+    Serial.println((int)(b0 | (b1 << 8)));
+  }
+  else {
+    long entry = ((long)b2 << 16) | ((long)b1 << 8) | b0;
+    //Sign extend the 23 bit value and restore the dropped bit
+    if (entry & 0x400000L) {
+      entry |= 0xFF800000L;
+    }
+    Serial.print(F("S "));
+    Serial.println(entry * 2);
+  }
+}
+
+/*
+  Starts capturing the fill curve
+  INPUTS:
+    Nil
+  OUTPUTS:
+    Nil
+*/
+void curveBegin() {
+  curveLength = 0;
+  curvePoints = 0;
+  curveStep = 1;
+  curveCountdown = 1;
+  curveActive = true;
+  curveRequest = false;
+  curveStartTime = millis();
+}
+
+/*
+  Adds a reading to the fill curve. Only every curveStep-th reading is stored.
+  INPUTS:
+    Scale reading
+  OUTPUTS:
+    Nil
+*/
+void curveSample(long reading) {
+  if (--curveCountdown > 0) {
+    return;
+  }
+  curveCountdown = curveStep;
+  if (curvePoints == 0) {
+    curveFirst = reading;
+    curveLast = reading;
+    curvePoints = 1;
+    return;
+  }
+  //A varint of a long takes at most 5 bytes
+  if (curveLength > CURVE_BYTES - 5 || curvePoints == 255) {
+    bool keep = (curvePoints % 2) == 0;
+    curveDecimate();
+    //Points are now every curveStep readings. An odd point falls between two of them
+    if (!keep) {
+      curveCountdown = curveStep / 2;
+      return;
+    }
+    curveCountdown = curveStep;
+  }
+  curveLength += putVarint(&curveBuffer[curveLength], reading - curveLast);
+  curveLast = reading;
+  curvePoints++;
+}
+
+/*
+  Halves the resolution of the fill curve in place by merging pairs of deltas. The merged
+  delta never takes more bytes than the pair, so the buffer can be rewritten as it is read.
+  INPUTS:
+    Nil
+  OUTPUTS:
+    Nil
+*/
+void curveDecimate() {
+  byte readIndex = 0;
+  byte writeIndex = 0;
+  byte points = 1;
+  long value = curveFirst;
+  long kept = curveFirst;
+  for (byte i = 1; i < curvePoints; i++) {
+    long delta;
+    readIndex += getVarint(&curveBuffer[readIndex], &delta);
+    value += delta;
+    if (i % 2 == 0) {
+      writeIndex += putVarint(&curveBuffer[writeIndex], value - kept);
+      kept = value;
+      points++;
+    }
+  }
+  curveLength = writeIndex;
+  curvePoints = points;
+  curveLast = kept;
+  curveStep *= 2;
+}
+
+/*
+  Stops capturing and saves the fill curve over the oldest curve in EEPROM
+  INPUTS:
+    Nil
+  OUTPUTS:
+    Nil
+*/
+void curveFinish() {
+  curveActive = false;
+  curveSeq++;
+  int slot = CURVE_ADDRESS + CURVE_SLOT_SIZE * (curveSeq % CURVE_SLOTS);
+  unsigned int duration = (millis() - curveStartTime) / 10;
+  //Mark the slot invalid until it is completely written
+  halStorageWrite(slot + 4, 0xFF);
+  halStorageWrite(slot, curveSeq);
+  halStorageWrite(slot + 1, modeIndex);
+  halStorageWrite(slot + 2, curveStep);
+  halStorageWrite(slot + 3, curvePoints);
+  EEPROMWrite(slot + 5, curveFirst);
+  halStorageWrite(slot + 9, duration);
+  halStorageWrite(slot + 10, duration >> 8);
+  for (byte i = 0; i < curveLength; i++) {
+    halStorageWrite(slot + CURVE_HEADER + i, curveBuffer[i]);
+  }
+  halStorageWrite(slot + 4, curveLength);
+  halStorageCommit();
+}
+
+/*
+  Prints the stored fill curves to Serial, oldest first. Each curve starts with
+    CURVE <seq> <mode> <readings per point> <points> <duration in 10 ms>
+  followed by one scale reading per line, decoded from EEPROM as they are printed.
+  INPUTS:
+    Nil
+  OUTPUTS:
+    Nil
+*/
+void printCurves() {
+  for (byte s = 1; s <= CURVE_SLOTS; s++) {
+    int slot = CURVE_ADDRESS + CURVE_SLOT_SIZE * ((curveSeq + s) % CURVE_SLOTS);
+    byte length = EEPROM.read(slot + 4);
+    byte points = EEPROM.read(slot + 3);
+    if (length > CURVE_BYTES || points == 0) {
+      continue;
+    }
+    Serial.print(F("CURVE "));
+    Serial.print(EEPROM.read(slot));
+    Serial.print(' ');
+    Serial.print(EEPROM.read(slot + 1) + 1);
+    Serial.print(' ');
+    Serial.print(EEPROM.read(slot + 2));
+    Serial.print(' ');
+    Serial.print(points);
+    Serial.print(' ');
+    Serial.println(EEPROM.read(slot + 9) | (EEPROM.read(slot + 10) << 8));
+    long value = EEPROMRead(slot + 5);
+    Serial.println(value);
+    int localAddress = slot + CURVE_HEADER;
+    for (byte i = 1; i < points; i++) {
+      //Decode one zigzag varint
+      unsigned long zigzag = 0;
+      byte shift = 0;
+      byte b;
+      do {
+        b = EEPROM.read(localAddress++);
+        zigzag |= (unsigned long)(b & 0x7F) << shift;
+        shift += 7;
+      } while (b & 0x80);
+      value += (long)(zigzag >> 1) ^ -(long)(zigzag & 1);
+      Serial.println(value);
+    }
+  }
+  Serial.println(F("CURVE END"));
+}
+
+/*
+  Writes a signed value as a zigzag varint: 7 bits per byte, lowest first, top bit set on
+  every byte but the last. Small deltas of either sign take one byte.
+  INPUTS:
+    Buffer to write to
+    Value to write
+  OUTPUTS:
+    Number of bytes written
+*/
+byte putVarint(byte *buffer, long value) {
+  unsigned long zigzag = ((unsigned long)value << 1) ^ (unsigned long)(value >> 31);
+  byte length = 0;
+  while (zigzag >= 0x80) {
+    buffer[length++] = zigzag | 0x80;
+    zigzag >>= 7;
+  }
+  buffer[length++] = zigzag;
+  return length;
+}
+
+/*
+  Reads a zigzag varint written by putVarint()
+  INPUTS:
+    Buffer to read from
+    Location to store the value
+  OUTPUTS:
+    Number of bytes read
+*/
+byte getVarint(const byte *buffer, long *value) {
+  unsigned long zigzag = 0;
+  byte length = 0;
+  byte shift = 0;
+  byte b;
+  do {
+    b = buffer[length++];
+    zigzag |= (unsigned long)(b & 0x7F) << shift;
+    shift += 7;
+  } while (b & 0x80);
+  *value = (long)(zigzag >> 1) ^ -(long)(zigzag & 1);
+  return length;
+}
+
+/*
+  Updates the EWMA and CUSUM charts of a mode with the settled result of its last fill.
+  On a shift the alarm is raised and, with auto adjust, the stop offset of the mode is moved
+  by the EWMA estimate of the shift and the charts restart.
+  INPUTS:
+    Settled scale reading after the fill
+  OUTPUTS:
+    Nil
+*/
+void spcResult(long settled) {
+  byte m = fillMode;
+  fillMode = 255;
+  long result = settled - fillTarget;
+  if (m > 2 || labs(result) > SPC_MAX_ERROR) {
+    return;
+  }
+  if (spcCount[m] < SPC_BASELINE) {
+    //Running mean of the first results sets the center line
+    spcCount[m]++;
+    spcCenter[m] += (result - spcCenter[m]) / spcCount[m];
+    if (spcCount[m] == SPC_BASELINE) {
+      EEPROMWrite(SPC_ADDRESS + 8 * m, spcCenter[m]);
+      EEPROMWrite(SPC_ADDRESS + 8 * m + 4, stopOffset[m]);
+    }
+    return;
+  }
+  long deviation = result - spcCenter[m];
+  spcEwma[m] += (deviation * 16 - spcEwma[m]) >> SPC_LAMBDA;
+  spcHigh[m] = max(0L, spcHigh[m] + deviation - spcK);
+  spcLow[m] = max(0L, spcLow[m] - deviation - spcK);
+  bool alarm = labs(spcEwma[m] / 16) > spcEwmaLimit || spcHigh[m] > spcH || spcLow[m] > spcH;
+  if (alarm && !spcAlarm[m]) {
+    Serial.print(F("SPC alarm mode "));
+    Serial.print(m + 1);
+    Serial.print(F(" shift "));
+    Serial.println(spcEwma[m] / 16);
+  }
+  spcAlarm[m] = alarm;
+  if (alarm && spcAutoAdjust) {
+    stopOffset[m] = constrain(stopOffset[m] + spcEwma[m] / 16, -MAX_OFFSET, MAX_OFFSET);
+    EEPROMWrite(SPC_ADDRESS + 8 * m + 4, stopOffset[m]);
+    Serial.print(F("Stop offset adjusted to "));
+    Serial.println(stopOffset[m]);
+    spcEwma[m] = 0;
+    spcHigh[m] = 0;
+    spcLow[m] = 0;
+  }
+}
+
+/*
+  Clears the charts and stop offset of a mode so the center line is learned again.
+  Called when the mode is calibrated.
+  INPUTS:
+    Index of the mode
+  OUTPUTS:
+    Nil
+*/
+void spcReset(byte localIndex) {
+  spcCount[localIndex] = 0;
+  spcCenter[localIndex] = 0;
+  spcEwma[localIndex] = 0;
+  spcHigh[localIndex] = 0;
+  spcLow[localIndex] = 0;
+  spcAlarm[localIndex] = false;
+  stopOffset[localIndex] = 0;
+  EEPROMWrite(SPC_ADDRESS + 8 * localIndex, -1);
+  EEPROMWrite(SPC_ADDRESS + 8 * localIndex + 4, -1);
+}
+
+/*
+  Prints the SPC limits and the state of each mode to Serial
+  INPUTS:
+    Nil
+  OUTPUTS:
+    Nil
+*/
+void printSpc() {
+  Serial.print(F("EWMA limit "));
+  Serial.print(spcEwmaLimit);
+  Serial.print(F(" k "));
+  Serial.print(spcK);
+  Serial.print(F(" h "));
+  Serial.print(spcH);
+  Serial.print(F(" auto "));
+  Serial.println(spcAutoAdjust);
+  Serial.println(F("Mode\tCenter\tEWMA\tC+\tC-\tOffset\tAlarm"));
+  for (byte i = 0; i < 3; i++) {
+    Serial.print(i + 1);
+    Serial.print('\t');
+    if (spcCount[i] < SPC_BASELINE) {
+      Serial.print(F("learn "));
+      Serial.print(spcCount[i]);
+    }
+    else {
+      Serial.print(spcCenter[i]);
+    }
+    Serial.print('\t');
+    Serial.print(spcEwma[i] / 16);
+    Serial.print('\t');
+    Serial.print(spcHigh[i]);
+    Serial.print('\t');
+    Serial.print(spcLow[i]);
+    Serial.print('\t');
+    Serial.print(stopOffset[i]);
+    Serial.print('\t');
+    Serial.println(spcAlarm[i]);
+  }
+}
+
+/*
+  Counts consecutive readings that stay within STABLE_BAND of the previous reading
+  INPUTS:
+    Current scale reading
+  OUTPUTS:
+    True once the platform has been stable for STABLE_COUNT readings
+*/
+bool updateStable(long reading) {
+  if (labs(reading - stableReading) > STABLE_BAND) {
+    stableCount = 0;
+  }
+  else if (stableCount < STABLE_COUNT) {
+    stableCount++;
+  }
+  stableReading = reading;
+  return stableCount >= STABLE_COUNT;
+}
+
+/*
+  Checkweigher. Tares on an empty reference container, then classifies every bottle placed on
+  the platform as under, ok or over against the calibrated volume of the selected mode and
+  TOLERANCE[]. Each bottle is weighed once the platform is stable. Press DISPENSE to exit.
+  INPUTS:
+    Nil
+  OUTPUTS:
+    Nil
+*/
+void checkweigh() {
+  int m = selection(false, F("Checkweigh"));
+  while (halButton(DISPENSE) == 0) {};
+  if (val[m] == -1 || calTare[m] == -1) {
+    lcd.print(F("Calibrate mode"));
+    lcd.setCursor(0, 1);
+    lcd.print(F("first"));
+    delay(2000);
+    return;
+  }
+  long expected = fillThreshold(m) - calTare[m];
+  long tolerance = (long)TOLERANCE[m] * expected / VOLUME[m];
+  lcd.print(F("Place empty ref"));
+  lcd.setCursor(0, 1);
+  lcd.print(F("Press DISPENSE"));
+  waitForDispense();
+  lcd.clear();
+  lcd.print(F("Taring..."));
+  while (!updateStable(readScale()) && machineFault == FAULT_NONE) {};
+  long tare = readAverage(5);
+  int counts[] = {0, 0, 0};     // under, ok, over
+  int total = 0;
+  unsigned long firstTime = 0;
+  unsigned long lastTime = 0;
+  bool loaded = false;
+  lcd.clear();
+  lcd.print(F("Place bottle"));
+  while (machineFault == FAULT_NONE) {
+    if (halButton(DISPENSE) == 0) {
+      while (halButton(DISPENSE) == 0) {};
+      break;
+    }
+    long reading = readScale();
+    bool stable = updateStable(reading);
+    long net = reading - tare;
+    if (loaded) {
+      //Wait for the bottle to be removed
+      if (net < expected / 2) {
+        loaded = false;
+      }
+      continue;
+    }
+    if (!stable || net < expected / 2) {
+      continue;
+    }
+    loaded = true;
+    long error = net - expected;
+    byte result = error < -tolerance ? 0 : (error > tolerance ? 2 : 1);
+    counts[result]++;
+    total++;
+    lastTime = millis();
+    if (total == 1) {
+      firstTime = lastTime;
+    }
+    //Bottles per minute over the intervals between bottles
+    long rate = total > 1 ? (long)(total - 1) * 60000 / (lastTime - firstTime) : 0;
+    long errorMl = error * 10 * VOLUME[m] / expected;
+    lcd.clear();
+    lcd.print(result == 0 ? F("UNDER ") : (result == 2 ? F("OVER  ") : F("OK    ")));
+    lcd.print(errorMl < 0 ? '-' : '+');
+    lcd.print(labs(errorMl) / 10);
+    lcd.print('.');
+    lcd.print(labs(errorMl) % 10);
+    lcd.print(F(" mL"));
+    lcd.setCursor(0, 1);
+    lcd.print('U');
+    lcd.print(counts[0]);
+    lcd.print(F(" K"));
+    lcd.print(counts[1]);
+    lcd.print(F(" O"));
+    lcd.print(counts[2]);
+    lcd.print(' ');
+    lcd.print(rate);
+    lcd.print(F("/m"));
+    Serial.print(F("CW "));
+    Serial.print(VOLUME[m]);
+    Serial.print(' ');
+    Serial.print(net);
+    Serial.print(' ');
+    Serial.print(errorMl);
+    Serial.print(' ');
+    Serial.print(result == 0 ? F("UNDER") : (result == 2 ? F("OVER") : F("OK")));
+    Serial.print(' ');
+    Serial.println(rate);
+  }
+}
+
+/*
+  Takes 'n' readings and returns their median to avoid stray readings. The time of the middle
+  reading is kept in medianTime
+  INPUTS:
+    Length of the median array. Always use odd numbers
+  OUTPUTS:
+    Median reading
+*/
+long readMedian(byte n) {
+  long medianArray[n];
+  for (byte m = 0; m < n; m++) {
+    //Log n readings into median array
+    medianArray[m] = readScale();
+    if (m == n / 2) {
+      medianTime = millis();
+    }
+    if (curveActive) {
+      curveSample(medianArray[m]);
+    }
+  }
+  long median = medianOf(medianArray, n);
+  for (byte x = 0; x < n; x++) {
+    printMsg(Serial, MSG_ARRAY);
+    Serial.print(x);
+    Serial.print(F(":\t"));
+    Serial.println(medianArray[x]);
+  }
+  return median;
+}
+
+/*
+  Sorts readings in place and picks the median
+  INPUTS:
+    Array of readings
+    Number of readings
+  OUTPUTS:
+    Median reading
+*/
+long medianOf(long *values, byte n) {
+  long temp = 0;
+  //Re-arrange median array in ascending order
+  for (byte  s = 0; s < n - 1; s++) {
+    for (byte t = 0; t < n - s - 1; t++) {
+      if (values[t] > values[t + 1]) {
+        temp = values[t];
+        values[t] = values[t + 1];
+        values[t + 1] = temp;
+      }
+    }
+  }
+  //The median value is the (n+1)/2th term of the array, index n/2 from 0
+  return values[n / 2];
+}
+
+/*
+  Turns an ingredient pump on or off. Pump 0 is the main relay.
+  INPUTS:
+    Index of the pump
+    True to turn the pump on
+  OUTPUTS:
+    Nil
+*/
+void setPump(byte pump, bool on) {
+  if (pump == 0) {
+    setRelay(on);
+  }
+  else {
+    digitalWrite(PUMP_PINS[pump], on ? HIGH : LOW);
+    if (on != bitRead(bbPumps, pump)) {
+      blackBoxEvent(on ? BB_RELAY_ON : BB_RELAY_OFF, pump);
+      bitWrite(bbPumps, pump, on);
+    }
+  }
+}
+
+/*
+  Scale counts per kg, from the linearization table if recorded, otherwise from the calibration
+  of the first mode assuming a density of 1 g/mL
+  INPUTS:
+    Nil
+  OUTPUTS:
+    Counts per kg, 0 if the scale was never calibrated
+*/
+long countsPerKg() {
+  if (linValid) {
+    return linRaw[LIN_POINTS - 1] * 1000 / LIN_MASS[LIN_POINTS - 1];
+  }
+  if (val[0] != -1 && calTare[0] != -1 && val[0] > calTare[0]) {
+    return (val[0] - calTare[0]) * 1000 / VOLUME[0];
+  }
+  return 0;
+}
+
+/*
+  Dispenses a recipe into one container. Ingredients are dispensed one after another, each
+  against a fresh tare, and the net mass of each stage is measured once drips have settled.
+  The error of each stage moves the learned stop offset of that ingredient.
+  Press DISPENSE during a stage to abort the recipe.
+  INPUTS:
+    Nil
+  OUTPUTS:
+    Nil
+*/
+void runRecipe() {
+  byte r = 0;
+  byte localSwitchState = 0;
+  bool aborted = false;
+  long cpk = countsPerKg();
+  while (halButton(DISPENSE) == 0) {};
+  lcd.clear();
+  if (cpk == 0) {
+    lcd.print(F("Calibrate first"));
+    delay(2000);
+    return;
+  }
+  //Choose the recipe with MODE and confirm with DISPENSE
+  while (halButton(DISPENSE) == 1) {
+    localSwitchState = DebounceSwitch();
+    if (localSwitchState == 1) {
+      r = (r + 1) % RECIPES;
+    }
+    lcd.setCursor(0, 0);
+    lcd.print(F("Recipe "));
+    lcd.print(r + 1);
+    lcd.print(F(": "));
+    lcd.print(RECIPE_VOLUME[r]);
+    lcd.print(F(" mL   "));
+    lcd.setCursor(0, 1);
+    lcd.print(F("DISPENSE to run"));
+  }
+  while (halButton(DISPENSE) == 0) {};
+  lcd.clear();
+  lcd.print(F("Place container"));
+  lcd.setCursor(0, 1);
+  lcd.print(F("Press DISPENSE"));
+  waitForDispense();
+  long totalMass = (long)RECIPE_VOLUME[r] * RECIPE_DENSITY[r] / 1000;
+  int sumParts = 0;
+  for (byte i = 0; i < INGREDIENTS; i++) {
+    sumParts += RECIPE_PARTS[r][i];
+  }
+  for (byte i = 0; i < INGREDIENTS && !aborted && machineFault == FAULT_NONE; i++) {
+    if (RECIPE_PARTS[r][i] == 0) {
+      continue;
+    }
+    long targetGrams = totalMass * RECIPE_PARTS[r][i] / sumParts;
+    long target = targetGrams * cpk / 1000;
+    lcd.clear();
+    lcd.print(F("Ingredient "));
+    lcd.print(i + 1);
+    lcd.setCursor(0, 1);
+    lcd.print(targetGrams);
+    lcd.print(F(" g"));
+    //Fresh tare for every stage
+    while (!updateStable(readScale()) && machineFault == FAULT_NONE) {};
+    long tare = readAverage(5);
+    long medianValue = tare;
+    setPump(i, true);
+    halWatchdog(true);
+    while (medianValue - tare < target - recipeOffset[i] && machineFault == FAULT_NONE) {
+      halWatchdogReset();
+      if (halButton(DISPENSE) == 0) {
+        aborted = true;
+        break;
+      }
+      medianValue = readMedian(medianWindow);
+    }
+    setPump(i, false);
+    halWatchdog(false);
+    if (aborted || machineFault != FAULT_NONE) {
+      break;
+    }
+    //Net mass of the stage once drips have settled
+    unsigned long offTime = millis();
+    while (millis() - offTime < DRIP_TIME) {
+      readScale();
+    }
+    long net = readAverage(5) - tare;
+    long error = net - target;
+    recipeOffset[i] = constrain(recipeOffset[i] + error / RECIPE_GAIN, -MAX_OFFSET, MAX_OFFSET);
+    EEPROMWrite(RECIPE_ADDRESS + 4 * i, recipeOffset[i]);
+    Serial.print(F("Recipe "));
+    Serial.print(r + 1);
+    Serial.print(F(" ingredient "));
+    Serial.print(i + 1);
+    Serial.print(F(" target "));
+    Serial.print(target);
+    Serial.print(F(" net "));
+    Serial.print(net);
+    Serial.print(F(" offset "));
+    Serial.println(recipeOffset[i]);
+    lcd.setCursor(0, 1);
+    lcd.print(net * 1000 / cpk);
+    lcd.print(F(" / "));
+    lcd.print(targetGrams);
+    lcd.print(F(" g    "));
+    delay(1000);
+  }
+  lcd.clear();
+  lcd.print(aborted ? F("Recipe aborted") : F("Recipe done"));
+  while (halButton(DISPENSE) == 0) {};
+  delay(1500);
+}
+
+/*
+  Starts a fill of the current mode and returns when the relay is turned off
+  INPUTS:
+    Scale reading after which relay must turn off, -1 for manual mode
+  OUTPUTS:
+    Nil
+*/
+void dispense(long threshold) {
+  lcd.clear();
+  lcd.setCursor(0, 0);
+  printMsg(lcd, MSG_DISPENSING);
+  lcd.setCursor(0, 1);
+  lcd.print(VOLUME[modeIndex]);
+  lcd.print(F("               "));
+  if (threshold != -1 && (curveRequest || (bottles[modeIndex] + 1) % CURVE_EVERY == 0)) {
+    curveBegin();
+  }
+  if (threshold != -1) {
+    fillMode = modeIndex;
+    fillTarget = threshold;
+    threshold -= stopOffset[modeIndex];
+  }
+  jobArmed = false;
+  if (threshold == -1) {
+    manualTare = readAverage(3);
+  }
+  setRelay(true);
+  control(threshold);
+}
+
+/*
+  Adds a job to the end of the queue
+  INPUTS:
+    Index of the mode
+    Number of bottles
+  OUTPUTS:
+    False if the queue is full
+*/
+bool addJob(byte mode, int count) {
+  if (jobLength >= JOB_SLOTS) {
+    return false;
+  }
+  jobMode[jobLength] = mode;
+  jobCount[jobLength] = count;
+  jobLength++;
+  return true;
+}
+
+/*
+  Counts a completed fill against the current job. When the job is complete the next job is
+  started, and the jobs stop when the queue is empty.
+  INPUTS:
+    Nil
+  OUTPUTS:
+    Nil
+*/
+void jobFillDone() {
+  if (!jobRunning || modeIndex != jobMode[0]) {
+    return;
+  }
+  if (++jobDone < jobCount[0]) {
+    return;
+  }
+  Serial.print(F("Job done: "));
+  Serial.print(jobCount[0]);
+  Serial.print(F(" x "));
+  Serial.print(VOLUME[jobMode[0]]);
+  Serial.println(F(" mL"));
+  jobLength--;
+  for (byte i = 0; i < jobLength; i++) {
+    jobMode[i] = jobMode[i + 1];
+    jobCount[i] = jobCount[i + 1];
+  }
+  jobDone = 0;
+  if (jobLength == 0) {
+    jobRunning = false;
+    Serial.println(F("All jobs done"));
+  }
+  else {
+    modeIndex = jobMode[0];
+    blackBoxEvent(BB_MODE, modeIndex);
+  }
+}
+
+/*
+  Queues jobs from the front panel. For each job the mode is chosen as for checkweighing and
+  the number of bottles with MODE from JOB_COUNTS[]. The queue starts when editing ends.
+  If jobs are already queued, DISPENSE resumes them without adding one.
+  INPUTS:
+    Nil
+  OUTPUTS:
+    Nil
+*/
+void editJobs() {
+  bool another = true;
+  if (jobLength > 0) {
+    while (halButton(DISPENSE) == 0) {};
+    lcd.clear();
+    if (jobLength < JOB_SLOTS) {
+      lcd.print(F("MODE: add job"));
+    }
+    else {
+      lcd.print(F("Queue full"));
+    }
+    lcd.setCursor(0, 1);
+    lcd.print(F("DISPENSE: start"));
+    another = false;
+    while (halButton(DISPENSE) == 1 && !another) {
+      another = DebounceSwitch() == 1 && jobLength < JOB_SLOTS;
+    }
+    while (halButton(DISPENSE) == 0) {};
+  }
+  while (another && jobLength < JOB_SLOTS) {
+    byte mode = selection(false, F("Batch jobs"));
+    byte c = 0;
+    while (halButton(DISPENSE) == 0) {};
+    //Choose the count with MODE and confirm with DISPENSE
+    while (halButton(DISPENSE) == 1) {
+      if (DebounceSwitch() == 1) {
+        c = (c + 1) % (sizeof(JOB_COUNTS) / sizeof(JOB_COUNTS[0]));
+      }
+      lcd.setCursor(0, 0);
+      lcd.print(VOLUME[mode]);
+      lcd.print(F(" mL x "));
+      lcd.print(JOB_COUNTS[c]);
+      lcd.print(F("     "));
+      lcd.setCursor(0, 1);
+      lcd.print(F("DISPENSE to add"));
+    }
+    while (halButton(DISPENSE) == 0) {};
+    addJob(mode, JOB_COUNTS[c]);
+    lcd.clear();
+    lcd.print(F("MODE: add more"));
+    lcd.setCursor(0, 1);
+    lcd.print(F("DISPENSE: start"));
+    another = false;
+    while (halButton(DISPENSE) == 1 && !another) {
+      another = DebounceSwitch() == 1;
+    }
+    while (halButton(DISPENSE) == 0) {};
+  }
+  if (jobLength > 0) {
+    jobRunning = true;
+    jobArmed = false;
+    modeIndex = jobMode[0];
+  }
+  printJobs();
+}
+
+/*
+  Prints the job queue to Serial
+  INPUTS:
+    Nil
+  OUTPUTS:
+    Nil
+*/
+void printJobs() {
+  Serial.print(jobRunning ? F("Jobs running, ") : F("Jobs stopped, "));
+  Serial.print(jobLength);
+  Serial.println(F(" queued"));
+  for (byte i = 0; i < jobLength; i++) {
+    Serial.print(i + 1);
+    Serial.print(F(": "));
+    Serial.print(VOLUME[jobMode[i]]);
+    Serial.print(F(" mL "));
+    Serial.print(i == 0 ? jobDone : 0);
+    Serial.print('/');
+    Serial.println(jobCount[i]);
+  }
+}
+
+/*
+  Counts a flow meter pulse and times it. Called from the interrupt on the rising edge
+  INPUTS:
+    Nil
+  OUTPUTS:
+    Nil
+*/
+void HAL_ISR flowPulse() {
+  unsigned long now = micros();
+  flowPeriod = now - flowPulseTime;
+  flowPulseTime = now;
+  flowPulses++;
+}
+
+/*
+  Reads the flow meter pulse count without the interrupt changing it halfway
+  INPUTS:
+    Nil
+  OUTPUTS:
+    Pulses counted since power on
+*/
+unsigned long flowCount() {
+  noInterrupts();
+  unsigned long pulses = flowPulses;
+  interrupts();
+  return pulses;
+}
+
+/*
+  Flow rate from the time between the last two flow meter pulses
+  INPUTS:
+    Nil
+  OUTPUTS:
+    Flow in mL/s, 0 if there was no pulse for FLOW_TIMEOUT
+*/
+int flowMlPerS() {
+  noInterrupts();
+  unsigned long last = flowPulseTime;
+  unsigned long period = flowPeriod;
+  interrupts();
+  if (period == 0 || micros() - last > FLOW_TIMEOUT * 1000UL) {
+    return 0;
+  }
+  return 1000000000UL / FLOW_PER_L / period;
+}
+
+/*
+  Starts fusing the flow meter with the scale for a fill of the current mode. Counts per pulse
+  start from the value learned for the mode, or from the scale calibration at 1 g/mL
+  INPUTS:
+    Reading at which the relay is turned off
+  OUTPUTS:
+    Nil
+*/
+void flowBegin(long stopAt) {
+  flowStopAt = stopAt;
+  flowStopped = false;
+  flowMass = -1;
+  flowRate = modeIndex < 3 ? flowCpp[modeIndex] : 0;
+  if (flowRate == 0) {
+    flowRate = countsPerKg() * 256 / FLOW_PER_L;
+  }
+  flowActive = true;
+}
+
+/*
+  Takes a median reading of the fill as the new base for the flow meter. Once enough pulses were
+  counted, counts per pulse are measured from the mass dispensed since the first reading, which
+  cancels the constant force of the falling liquid
+  INPUTS:
+    Median reading
+  OUTPUTS:
+    Nil
+*/
+void flowWeight(long reading) {
+  unsigned long pulses = flowCount();
+  if (flowMass == -1) {
+    flowStartMass = reading;
+    flowStartPulses = pulses;
+  }
+  else if (pulses - flowStartPulses >= FLOW_MIN_PULSES && reading > flowStartMass) {
+    flowRate = (reading - flowStartMass) * 256 / (long)(pulses - flowStartPulses);
+  }
+  flowMass = reading;
+  flowRefPulses = pulses;
+}
+
+/*
+  Turns the relay off as soon as the reading carried forward by the flow meter reaches the stop
+  point. Called while waiting for the HX711, so it runs many times between readings
+  INPUTS:
+    Nil
+  OUTPUTS:
+    Nil
+*/
+void flowCheck() {
+  if (!flowActive || flowStopped || flowMass == -1 || flowRate <= 0) {
+    return;
+  }
+  unsigned long pulses = flowCount();
+  if (pulses == flowRefPulses) {
+    return;
+  }
+  long estimate = flowMass + (long)(pulses - flowRefPulses) * flowRate / 256;
+  if (estimate + stopLead >= flowStopAt) {
+    setRelay(false);
+    flowStopped = true;
+  }
+}
+
+/*
+  Ends the fusion of a fill. Counts per pulse measured in the fill move the learned value of the
+  mode, which is saved when it changed by more than 1%
+  INPUTS:
+    Nil
+  OUTPUTS:
+    Nil
+*/
+void flowEnd() {
+  flowActive = false;
+  if (modeIndex >= 3 || flowMass == -1 || flowRefPulses - flowStartPulses < FLOW_MIN_PULSES) {
+    return;
+  }
+  if (flowCpp[modeIndex] == 0) {
+    flowCpp[modeIndex] = flowRate;
+  }
+  else {
+    flowCpp[modeIndex] += (flowRate - flowCpp[modeIndex]) / FLOW_GAIN;
+  }
+  long saved = EEPROMRead(FLOW_ADDRESS + 4 * modeIndex);
+  if (labs(flowCpp[modeIndex] - saved) * 100 > labs(saved)) {
+    EEPROMWrite(FLOW_ADDRESS + 4 * modeIndex, flowCpp[modeIndex]);
+  }
+  Serial.print(F("Density: "));
+  Serial.print(flowDensity(flowRate));
+  Serial.println(F(" g/L"));
+}
+
+/*
+  Density of the liquid from the scale counts per flow meter pulse
+  INPUTS:
+    Counts per pulse (Q8)
+  OUTPUTS:
+    Density in g/L, 0 if the scale was never calibrated
+*/
+long flowDensity(long cpp) {
+  long cpk = countsPerKg();
+  if (cpk <= 0) {
+    return 0;
+  }
+  return cpp * FLOW_PER_L / 256 * 1000 / cpk;
+}
+
+/*
+  Prints the learned counts per pulse and density of each mode on serial
+  INPUTS:
+    Nil
+  OUTPUTS:
+    Nil
+*/
+void printFlow() {
+  Serial.print(F("Flow pulses: "));
+  Serial.print(flowCount());
+  Serial.print(F("\tFlow: "));
+  Serial.print(flowMlPerS());
+  Serial.println(F(" mL/s"));
+  for (byte i = 0; i < 3; i++) {
+    Serial.print(F("Mode "));
+    Serial.print(i + 1);
+    if (flowCpp[i] == 0) {
+      Serial.println(F(": not learned"));
+      continue;
+    }
+    Serial.print(F(": counts/pulse "));
+    Serial.print(flowCpp[i] / 256.0);
+    Serial.print(F("\tdensity "));
+    Serial.print(flowDensity(flowCpp[i]));
+    Serial.println(F(" g/L"));
+  }
+}
+
+/*
+  Learns the flow rate of a mode from the time the relay was on during a healthy fill. Fills
+  that started on a partly filled container are not used
+  INPUTS:
+    Index of the mode
+    Counts from the first reading of the fill to the stop point
+  OUTPUTS:
+    Nil
+*/
+void doseLearn(byte localIndex, long fillMass) {
+  if (localIndex >= 3 || relayRunTime < DOSE_MIN_TIME || relayRunTime > DOSE_MAX_TIME) {
+    return;
+  }
+  if (calTare[localIndex] != -1 && fillMass < (val[localIndex] - calTare[localIndex]) / 4 * 3) {
+    return;
+  }
+  long rate = VOLUME[localIndex] * 1000000L / relayRunTime;
+  if (doseRate[localIndex] == 0) {
+    doseRate[localIndex] = rate;
+  }
+  else {
+    doseRate[localIndex] += (rate - doseRate[localIndex]) / DOSE_GAIN;
+  }
+  long saved = EEPROMRead(DOSE_ADDRESS + 4 * localIndex);
+  if (labs(doseRate[localIndex] - saved) * 100 > labs(saved)) {
+    EEPROMWrite(DOSE_ADDRESS + 4 * localIndex, doseRate[localIndex]);
+  }
+}
+
+/*
+  Front panel while the scale is faulted. MODE selects one of the fill modes and DISPENSE
+  doses it by time if its flow rate was learned
+  INPUTS:
+    Nil
+  OUTPUTS:
+    Nil
+*/
+void timedDoseLoop() {
+  if (modeIndex >= 3) {
+    modeIndex = 0;
+  }
+  //DebounceSwitch() expects to be called about every 100 ms like readScale() paces loop()
+  delay(10);
+  if (DebounceSwitch() == 1) {
+    modeIndex = (modeIndex + 1) % 3;
+    blackBoxEvent(BB_MODE, modeIndex);
+  }
+  serialCommands();
+  if (halButton(DISPENSE) == 0 && doseRate[modeIndex] > 0) {
+    timedDose(modeIndex);
+    diagSkip();
+  }
+}
+
+/*
+  Dispenses the volume of a mode by running the pump for the time given by the learned flow
+  rate. Press MODE to abort
+  INPUTS:
+    Index of the mode
+  OUTPUTS:
+    Nil
+*/
+void timedDose(byte localIndex) {
+  unsigned long doseTime = VOLUME[localIndex] * 1000000L / doseRate[localIndex];
+  if (doseTime > DOSE_MAX_TIME) {
+    doseTime = DOSE_MAX_TIME;
+  }
+  lcd.setCursor(0, 1);
+  lcd.print(F("Timed dosing    "));
+  Serial.print(F("Timed dose, scale fault "));
+  Serial.print(machineFault);
+  Serial.print(F(": mode "));
+  Serial.print(localIndex + 1);
+  Serial.print(F(" for "));
+  Serial.print(doseTime);
+  Serial.println(F(" ms"));
+  blackBoxEvent(BB_DOSE, localIndex);
+  halWatchdog(true);
+  setRelay(true);
+  unsigned long start = millis();
+  bool aborted = false;
+  while (millis() - start < doseTime) {
+    halWatchdogReset();
+    if (halButton(MODE) == 0) {
+      aborted = true;
+      break;
+    }
+  }
+  setRelay(false);
+  halWatchdog(false);
+  lcd.setCursor(0, 1);
+  if (aborted) {
+    lcd.print(F("Dose aborted    "));
+    Serial.println(F("Timed dose aborted"));
+  }
+  else {
+    countFill(localIndex);
+    lcd.print(F("Dose done       "));
+    Serial.println(F("Timed dose done"));
+  }
+  while (halButton(DISPENSE) == 0 || halButton(MODE) == 0) {
+  }
+}
+
+/*
+  Prints the learned flow rate and timed dose of each mode on serial
+  INPUTS:
+    Nil
+  OUTPUTS:
+    Nil
+*/
+void printDose() {
+  for (byte i = 0; i < 3; i++) {
+    Serial.print(F("Mode "));
+    Serial.print(i + 1);
+    if (doseRate[i] == 0) {
+      Serial.println(F(": not learned"));
+      continue;
+    }
+    Serial.print(F(": "));
+    Serial.print(doseRate[i] / 1000.0);
+    Serial.print(F(" mL/s\tdose "));
+    Serial.print(VOLUME[i] * 1000000L / doseRate[i]);
+    Serial.println(F(" ms"));
+  }
+}
+
+/*
+  Primes the hose into a waste container. The pump runs until the mass rises, then for
+  PRIME_PURGE more to purge air. With the hose full the hose delay is then measured and saved.
+  Press DISPENSE to abort
+  INPUTS:
+    Nil
+  OUTPUTS:
+    Nil
+*/
+void primePump() {
+  lcd.clear();
+  lcd.setCursor(0, 0);
+  lcd.print(F("Priming"));
+  lcd.setCursor(0, 1);
+  lcd.print(F("Waiting for flow"));
+  while (halButton(DISPENSE) == 0) {
+  }
+  noiseOff = measureNoise(NOISE_SAMPLES);
+  long baseline = readMedian(3);
+  long last = baseline;
+  long flowTime = -1;
+  float noiseSum = 0;
+  float noiseSquares = 0;
+  byte noiseCount = 0;
+  halWatchdog(true);
+  setRelay(true);
+  unsigned long start = millis();
+  while (machineFault == FAULT_NONE && halButton(DISPENSE) != 0) {
+    halWatchdogReset();
+    long reading = readScale();
+    unsigned long elapsed = millis() - start;
+    //The pump runs into the waste container during the purge, which gives its noise
+    if (flowTime != -1 && noiseCount < 255) {
+      float d = reading - last;
+      noiseSum += d;
+      noiseSquares += d * d;
+      noiseCount++;
+    }
+    last = reading;
+    if (flowTime == -1 && reading - baseline > PRIME_RISE) {
+      flowTime = elapsed;
+      lcd.setCursor(0, 1);
+      lcd.print(F("Purging         "));
+    }
+    if ((flowTime != -1 && elapsed - flowTime >= PRIME_PURGE) || (flowTime == -1 && elapsed > PRIME_TIMEOUT)) {
+      break;
+    }
+  }
+  setRelay(false);
+  bool measured = noiseCount >= NOISE_MIN;
+  if (measured) {
+    noiseOn = noiseSigma(noiseSum, noiseSquares, noiseCount);
+  }
+  long delayTime = -1;
+  if (flowTime != -1 && machineFault == FAULT_NONE && halButton(DISPENSE) != 0) {
+    lcd.setCursor(0, 1);
+    lcd.print(F("Hose delay      "));
+    delayTime = measureHoseDelay();
+  }
+  halWatchdog(false);
+  if (machineFault != FAULT_NONE) {
+    return;
+  }
+  lcd.setCursor(0, 1);
+  if (flowTime == -1) {
+    lcd.print(F("No flow         "));
+    Serial.println(F("Prime: no flow"));
+  }
+  else if (delayTime == -1) {
+    lcd.print(F("No hose delay   "));
+    Serial.print(F("Prime: hose filled in "));
+    Serial.print(flowTime);
+    Serial.println(F(" ms, hose delay not measured"));
+  }
+  else {
+    hoseDelay = delayTime;
+    EEPROMWrite(PRIME_ADDRESS, hoseDelay);
+    lcd.print(F("Hose delay "));
+    lcd.print(hoseDelay);
+    lcd.print(F("ms  "));
+    Serial.print(F("Prime: hose filled in "));
+    Serial.print(flowTime);
+    Serial.print(F(" ms, hose delay "));
+    Serial.print(hoseDelay);
+    Serial.println(F(" ms"));
+  }
+  if (measured) {
+    medianWindow = filterWindow(noiseOn);
+    EEPROMWrite(FILTER_ADDRESS, medianWindow);
+    lcd.setCursor(0, 0);
+    printMsg(lcd, MSG_FILTER);
+    lcd.print(medianWindow);
+    lcd.print(F("       "));
+    printNoise();
+  }
+  while (halButton(DISPENSE) == 0) {
+  }
+  delay(1500);
+}
+
+/*
+  Measures the time from pump on to the first rise of the mass with the hose already full, which
+  is how long liquid keeps arriving after the relay turns off. The onset is extrapolated back
+  from the first two readings above PRIME_RISE, so the sample period does not add to it.
+  Called with the watchdog on and the relay off
+  INPUTS:
+    Nil
+  OUTPUTS:
+    Hose delay in ms, -1 if the mass did not rise within PRIME_DELAY_MAX
+*/
+long measureHoseDelay() {
+  //Let the purge drain before taking the baseline
+  unsigned long offTime = millis();
+  while (millis() - offTime < DRIP_TIME && machineFault == FAULT_NONE) {
+    halWatchdogReset();
+    readScale();
+  }
+  long baseline = readMedian(3);
+  long firstRise = -1;
+  unsigned long firstTime = 0;
+  long result = -1;
+  setRelay(true);
+  unsigned long start = millis();
+  while (machineFault == FAULT_NONE && halButton(DISPENSE) != 0 && millis() - start < PRIME_DELAY_MAX) {
+    halWatchdogReset();
+    long rise = readScale() - baseline;
+    unsigned long elapsed = millis() - start;
+    if (rise <= PRIME_RISE) {
+      continue;
+    }
+    if (firstRise == -1) {
+      firstRise = rise;
+      firstTime = elapsed;
+      continue;
+    }
+    if (rise > firstRise) {
+      result = firstTime - firstRise * (long)(elapsed - firstTime) / (rise - firstRise);
+      result = max(result, 0L);
+    }
+    break;
+  }
+  setRelay(false);
+  return result;
+}
+
+/*
+  Closes the anti-drip valve once valveOffset has passed since the pump turned off, and keeps
+  the last reading at that moment to measure the drip from. Called while waiting for the HX711
+  so the close time does not depend on the sample rate
+  INPUTS:
+    Nil
+  OUTPUTS:
+    Nil
+*/
+void updateValve() {
+  if (valveState == 1 && millis() - (relayOnTime + relayRunTime) >= (unsigned long)valveOffset) {
+    digitalWrite(VALVE_PIN, LOW);
+    valveReading = scaleReading;
+    valveState = 2;
+  }
+}
+
+/*
+  Measures the mass dripping between the valve closing and DRIP_TIME after the pump turned
+  off, and tunes valveOffset to keep it below VALVE_DRIP. Only automatic fills tune, and only
+  when loop() sees the end of DRIP_TIME within VALVE_LATE, as other pump runs block loop()
+  INPUTS:
+    Current reading
+  OUTPUTS:
+    Nil
+*/
+void valveDrip(long reading) {
+  updateValve();
+  unsigned long elapsed = millis() - (relayOnTime + relayRunTime);
+  if (valveState != 2 || elapsed < DRIP_TIME) {
+    return;
+  }
+  valveState = 0;
+  if (!valveTune || elapsed > DRIP_TIME + VALVE_LATE) {
+    return;
+  }
+  long drip = reading - valveReading;
+  Serial.print(F("Drip: "));
+  Serial.println(drip);
+  if (!valveAuto || labs(drip) > SPC_MAX_ERROR) {
+    return;
+  }
+  long offset = valveOffset;
+  if (drip > VALVE_DRIP) {
+    offset -= VALVE_STEP;
+  }
+  else if (drip < VALVE_DRIP / 2) {
+    offset += VALVE_STEP;
+  }
+  offset = constrain(offset, 0L, (long)VALVE_MAX);
+  if (offset != valveOffset) {
+    valveOffset = offset;
+    EEPROMWrite(VALVE_ADDRESS, valveOffset);
+  }
+}
+
+/*
+  Prints the anti-drip valve timing on serial
+  INPUTS:
+    Nil
+  OUTPUTS:
+    Nil
+*/
+void printValve() {
+  Serial.print(F("Valve closes "));
+  Serial.print(valveOffset);
+  Serial.print(F(" ms after the pump, auto tune "));
+  Serial.println(valveAuto ? F("on") : F("off"));
+}
+
+/*
+  Extrapolates the rise between the last two medians of a fill to the time the stop point will
+  be crossed
+  INPUTS:
+    Counts left to the stop point
+    Rise in counts since the last median
+    Time in ms between the last two medians
+    Time in ms since the last median was taken
+  OUTPUTS:
+    Delay in ms after which the relay must turn off, -1 if not before the next median
+*/
+long predictCutoff(long remaining, long rise, long interval, long age) {
+  if (rise <= 0 || remaining <= 0) {
+    return -1;
+  }
+  long ahead = remaining * interval / rise;
+  long due = max(ahead - age, 0L);
+  if (ahead >= interval || due >= PREDICT_MAX) {
+    return -1;
+  }
+  return due;
+}
+
+/*
+  Sets Timer1 to turn the relay off after a delay. Any earlier setting is replaced. Boards
+  without Timer1 poll for the delay in cutoffCheck()
+  INPUTS:
+    Delay in ms, at most PREDICT_MAX
+  OUTPUTS:
+    Nil
+*/
+void scheduleCutoff(long due) {
+  cutoffStart = millis();
+  cutoffDue = due;
+  cutoffArmed = !halTimerStart(due);
+}
+
+/*
+  Stops Timer1 if it has not turned the relay off yet
+  INPUTS:
+    Nil
+  OUTPUTS:
+    Nil
+*/
+void cancelCutoff() {
+  cutoffArmed = false;
+  halTimerStop();
+}
+
+/*
+  Turns the relay off at the time set by scheduleCutoff(). Called from the timer interrupt
+  INPUTS:
+    Nil
+  OUTPUTS:
+    Nil
+*/
+void cutoffInterrupt() {
+  digitalWrite(RELAY_PIN, LOW);
+  cutoffTime = millis();
+  cutoffFired = true;
+}
+
+/*
+  Completes a Timer1 cut-off with the bookkeeping of setRelay(). Called while waiting for the
+  HX711 so the valve is timed from the actual cut-off
+  INPUTS:
+    Nil
+  OUTPUTS:
+    Nil
+*/
+void cutoffCheck() {
+  if (cutoffArmed && millis() - cutoffStart >= cutoffDue) {
+    cutoffArmed = false;
+    cutoffInterrupt();
+  }
+  if (cutoffFired && relayState) {
+    setRelay(false);
+  }
+}
+
+/*
+  Times the filter path (median of 3 and 7, linearization, temperature and density lookup) and
+  the control path (threshold, flow estimate and cut-off prediction) on serial. Compare the
+  cycles per call between boards
+  INPUTS:
+    Nil
+  OUTPUTS:
+    Nil
+*/
+void runBench() {
+  long values[7];
+  volatile long sink = 0;
+  unsigned long start = micros();
+  for (int i = 0; i < BENCH_RUNS; i++) {
+    for (byte j = 0; j < 3; j++) {
+      values[j] = (i * 7919L + j * 104729L) & 0xFFFF;
+    }
+    sink += medianOf(values, 3);
+  }
+  printBench(F("Median of 3"), micros() - start);
+  start = micros();
+  for (int i = 0; i < BENCH_RUNS; i++) {
+    for (byte j = 0; j < 7; j++) {
+      values[j] = (i * 7919L + j * 104729L) & 0xFFFF;
+    }
+    sink += medianOf(values, 7);
+  }
+  printBench(F("Median of 7"), micros() - start);
+  start = micros();
+  for (int i = 0; i < BENCH_RUNS; i++) {
+    sink += linearize(scaleZero + i * 1000L);
+    sink += densityPpm(lookupTemperature(i * 5));
+  }
+  printBench(F("Linearize and temperature"), micros() - start);
+  //Per median of a fill with canned readings: flow meter fusion, the check made while waiting
+  //for the HX711 and the cut-off prediction. The stop point is out of reach
+  flowBegin(0x7FFFFFFL);
+  flowRate = 256;
+  start = micros();
+  for (int i = 0; i < BENCH_RUNS; i++) {
+    flowWeight(scaleZero + i * 100L);
+    flowRefPulses = flowCount() - 1;
+    flowCheck();
+    sink += predictCutoff(5000 - (i % 50) * 100L, 1000 + i % 200, 300, i % 100);
+  }
+  printBench(F("Control step"), micros() - start);
+  flowActive = false;
+  start = micros();
+  for (int i = 0; i < BENCH_RUNS; i++) {
+    scheduleCutoff(PREDICT_MAX - 1);
+    cancelCutoff();
+  }
+  printBench(F("Cut-off timer"), micros() - start);
+}
+
+/*
+  Prints the time per call of a benchmarked path, including the loop around it
+  INPUTS:
+    Name of the path
+    Time in us for BENCH_RUNS calls
+  OUTPUTS:
+    Nil
+*/
+void printBench(const __FlashStringHelper *name, unsigned long elapsed) {
+  Serial.print(name);
+  Serial.print(F(": "));
+  Serial.print((float)elapsed / BENCH_RUNS);
+  Serial.print(F(" us, "));
+  Serial.print(elapsed * clockCyclesPerMicrosecond() / BENCH_RUNS);
+  Serial.println(F(" cycles"));
+}
+
+/*
+  Reset flags of the last reset, cleared for the next one
+  INPUTS:
+    Nil
+  OUTPUTS:
+    MCUSR on AVR, 0 on other boards
+*/
+byte halResetCause() {
+#if defined(__AVR__)
+  byte cause = MCUSR;
+  MCUSR = 0;
+  return cause;
+#else
+  return 0;
+#endif
+}
+
+/*
+  Starts the EEPROM. 32-bit boards emulate it in flash and need its size
+  INPUTS:
+    Nil
+  OUTPUTS:
+    Nil
+*/
+void halStorageBegin() {
+#if defined(ESP32) || defined(ESP8266) || defined(ARDUINO_ARCH_RP2040)
+  EEPROM.begin(EEPROM_SIZE);
+#endif
+}
+
+/*
+  Writes one EEPROM byte if it changed. Boards that emulate the EEPROM in flash keep the
+  change in RAM until halStorageCommit()
+  INPUTS:
+    Address
+    Value
+  OUTPUTS:
+    Nil
+*/
+void halStorageWrite(int address, byte value) {
+#if defined(__AVR__)
+  EEPROM.update(address, value);
+#else
+  if (EEPROM.read(address) != value) {
+    EEPROM.write(address, value);
+    halStorageDirty = true;
+  }
+#endif
+}
+
+/*
+  Writes the changes since the last commit to flash on boards that emulate the EEPROM. Called
+  once per saved value, so a value costs one flash write and not one per byte
+  INPUTS:
+    Nil
+  OUTPUTS:
+    Nil
+*/
+void halStorageCommit() {
+#if defined(ESP32) || defined(ESP8266) || defined(ARDUINO_ARCH_RP2040)
+  if (halStorageDirty) {
+    EEPROM.commit();
+  }
+#endif
+  halStorageDirty = false;
+}
+
+/*
+  Turns the 2 s watchdog used during fills on or off. ESP32 uses the task watchdog for the
+  loop task. SAMD, STM32 and RP2040 have no fill watchdog
+  INPUTS:
+    True to turn it on
+  OUTPUTS:
+    Nil
+*/
+void halWatchdog(bool on) {
+#if defined(__AVR__)
+  if (on) {
+    wdt_enable(WDTO_2S);
+  }
+  else {
+    wdt_disable();
+  }
+#elif defined(ESP32)
+  static bool started = false;
+  if (!started) {
+#if ESP_IDF_VERSION_MAJOR >= 5
+    esp_task_wdt_config_t config = {2000, 0, true};
+    if (esp_task_wdt_init(&config) != ESP_OK) {
+      esp_task_wdt_reconfigure(&config);
+    }
+#else
+    esp_task_wdt_init(2, true);
+#endif
+    started = true;
+  }
+  if (on) {
+    esp_task_wdt_add(NULL);
+  }
+  else {
+    esp_task_wdt_delete(NULL);
+  }
+#else
+  (void)on;
+#endif
+}
+
+/*
+  Restarts the watchdog timeout
+  INPUTS:
+    Nil
+  OUTPUTS:
+    Nil
+*/
+void halWatchdogReset() {
+#if defined(__AVR__)
+  wdt_reset();
+#elif defined(ESP32)
+  esp_task_wdt_reset();
+#endif
+}
+
+/*
+  Sets up the flow meter input and its interrupt
+  INPUTS:
+    Nil
+  OUTPUTS:
+    Nil
+*/
+void halFlowBegin() {
+  pinMode(FLOW_PIN, INPUT_PULLUP);
+#if defined(__AVR__)
+  //Pin 12 has no external interrupt on the ATmega328, use the port B pin change interrupt
+  PCMSK0 |= _BV(PCINT4);
+  PCICR |= _BV(PCIE0);
+#else
+  attachInterrupt(digitalPinToInterrupt(FLOW_PIN), flowPulse, RISING);
+#endif
+}
+
+/*
+  Reads a front panel button
+  INPUTS:
+    Pin of the button
+  OUTPUTS:
+    0 while pressed, 1 when released
+*/
+byte halButton(byte pin) {
+  return digitalRead(pin);
+}
+
+/*
+  Starts the HX711
+  INPUTS:
+    Nil
+  OUTPUTS:
+    Nil
+*/
+void halScaleBegin() {
+  scale.begin(LOADCELL_DOUT, LOADCELL_SCK);
+}
+
+/*
+  Checks if the HX711 has a reading ready
+  INPUTS:
+    Nil
+  OUTPUTS:
+    True if a reading is ready
+*/
+bool halScaleReady() {
+  return scale.is_ready();
+}
+
+/*
+  Reads the HX711. Only call once halScaleReady() is true
+  INPUTS:
+    Nil
+  OUTPUTS:
+    Raw HX711 reading
+*/
+long halScaleRead() {
+  return scale.read();
+}
+
+/*
+  Powers the HX711 down or up
+  INPUTS:
+    True to power up
+  OUTPUTS:
+    Nil
+*/
+void halScalePower(bool on) {
+  if (on) {
+    scale.power_up();
+  }
+  else {
+    scale.power_down();
+  }
+}
+
+/*
+  Sets Timer1 to call cutoffInterrupt() after a delay. Any earlier setting is replaced. Other
+  boards have no timer set aside and return false, so the delay is polled
+  INPUTS:
+    Delay in ms, at most PREDICT_MAX
+  OUTPUTS:
+    True if the timer was set
+*/
+bool halTimerStart(long due) {
+#if defined(__AVR__)
+  noInterrupts();
+  TCCR1A = 0;
+  TCCR1B = 0;
+  TCNT1 = 0;
+  //Prescaler 256, 16 us per tick at 16 MHz
+  OCR1A = max(1UL, (unsigned long)due * (F_CPU / 256) / 1000);
+  TIFR1 = _BV(OCF1A);
+  TIMSK1 = _BV(OCIE1A);
+  TCCR1B = _BV(CS12);
+  interrupts();
+  return true;
+#else
+  (void)due;
+  return false;
+#endif
+}
+
+/*
+  Stops Timer1 if it has not fired yet
+  INPUTS:
+    Nil
+  OUTPUTS:
+    Nil
+*/
+void halTimerStop() {
+#if defined(__AVR__)
+  noInterrupts();
+  TCCR1B = 0;
+  TIMSK1 = 0;
+  interrupts();
+#endif
+}
+
+/*
+  Sleeps until a button is pressed or a character arrives on serial. On AVR the MCU is in
+  power down with the pin change interrupts of port D as the wake up, other boards poll
+  INPUTS:
+    Nil
+  OUTPUTS:
+    Nil
+*/
+void halSleep() {
+#if defined(__AVR__)
+  byte adc = ADCSRA;
+  ADCSRA = 0;
+  //DISPENSE, MODE and RX
+  PCMSK2 |= _BV(PCINT18) | _BV(PCINT19) | _BV(PCINT16);
+  PCIFR = _BV(PCIF2);
+  PCICR |= _BV(PCIE2);
+  set_sleep_mode(SLEEP_MODE_PWR_DOWN);
+  noInterrupts();
+  sleep_enable();
+  interrupts();
+  sleep_cpu();
+  sleep_disable();
+  PCICR &= ~_BV(PCIE2);
+  PCMSK2 = 0;
+  ADCSRA = adc;
+#else
+  while (halButton(DISPENSE) != 0 && halButton(MODE) != 0 && !Serial.available()) {
+    delay(20);
+  }
+#endif
+}
+
+#if defined(__AVR__)
+extern uint8_t __data_start;
+extern uint8_t _end;
+extern uint8_t __stack;
+extern uint8_t __data_load_end;
+
+/*
+  Fills the RAM above the static variables with STACK_CANARY before main() runs. The stack
+  overwrites it as it grows, so the bytes still holding it show the deepest the stack has been
+  INPUTS:
+    Nil
+  OUTPUTS:
+    Nil
+*/
+void halStackPaint() __attribute__((naked, used, section(".init3")));
+void halStackPaint() {
+  uint8_t *p = &_end;
+  while (p <= &__stack) {
+    *p++ = STACK_CANARY;
+  }
+}
+#endif
+
+/*
+  Bytes of RAM used by initialized, zeroed and .noinit variables
+  INPUTS:
+    Nil
+  OUTPUTS:
+    Bytes, -1 where not known
+*/
+long halStaticRam() {
+#if defined(__AVR__)
+  return &_end - &__data_start;
+#else
+  return -1;
+#endif
+}
+
+/*
+  Bytes of RAM between the static variables and the stack pointer now
+  INPUTS:
+    Nil
+  OUTPUTS:
+    Bytes, -1 where not known
+*/
+long halFreeRam() {
+#if defined(__AVR__)
+  return (uint8_t *)(uintptr_t)SP - &_end;
+#else
+  return -1;
+#endif
+}
+
+/*
+  Bytes of RAM the stack has never reached since reset, from halStackPaint()
+  INPUTS:
+    Nil
+  OUTPUTS:
+    Bytes, -1 where not known
+*/
+long halStackUnused() {
+#if defined(__AVR__)
+  const uint8_t *p = &_end;
+  while (p <= &__stack && *p == STACK_CANARY) {
+    p++;
+  }
+  return p - &_end;
+#else
+  return -1;
+#endif
+}
+
+/*
+  Deepest the stack has been since reset
+  INPUTS:
+    Nil
+  OUTPUTS:
+    Bytes, -1 where not known
+*/
+long halStackPeak() {
+#if defined(__AVR__)
+  return &__stack + 1 - &_end - halStackUnused();
+#else
+  return -1;
+#endif
+}
+
+/*
+  Bytes of flash used by code, constants and the initial values of variables
+  INPUTS:
+    Nil
+  OUTPUTS:
+    Bytes, -1 where not known
+*/
+long halFlashUsed() {
+#if defined(__AVR__)
+  return (uintptr_t)&__data_load_end;
+#else
+  return -1;
+#endif
+}
+
+#if defined(__AVR__)
+/*
+  Pin change interrupt of port D. Only wakes the MCU from halSleep()
+  INPUTS:
+    Nil
+  OUTPUTS:
+    Nil
+*/
+ISR(PCINT2_vect) {
+}
+
+/*
+  Pin change interrupt of port B. Counts the rising edges of the flow meter
+  INPUTS:
+    Nil
+  OUTPUTS:
+    Nil
+*/
+ISR(PCINT0_vect) {
+  if (digitalRead(FLOW_PIN) == HIGH) {
+    flowPulse();
+  }
+}
+
+/*
+  Timer1 compare match set by halTimerStart(). Stops the timer and cuts off the relay
+  INPUTS:
+    Nil
+  OUTPUTS:
+    Nil
+*/
+ISR(TIMER1_COMPA_vect) {
+  TCCR1B = 0;
+  TIMSK1 = 0;
+  cutoffInterrupt();
+}
+#endif
+
+/*
+  Puts the machine to sleep after IDLE_MINUTES without activity. A button, the relay, jobs,
+  pending drip and weld checks, serial input or an unstable platform count as activity
+  INPUTS:
+    Nil
+  OUTPUTS:
+    Nil
+*/
+void checkIdle() {
+  static unsigned long lastActivity = 0;
+  if (IDLE_MINUTES == 0) {
+    return;
+  }
+  if (halButton(DISPENSE) == 0 || halButton(MODE) == 0 || relayState || jobRunning || weldState != 0 ||
+      valveState != 0 || curveActive || stableCount < STABLE_COUNT || Serial.available()) {
+    lastActivity = millis();
+    return;
+  }
+  if (millis() - lastActivity >= IDLE_MINUTES * 60000UL) {
+    idleSleep();
+    diagSkip();
+    lastActivity = millis();
+  }
+}
+
+/*
+  Powers down the HX711 and the display and sleeps until woken. On waking the HX711 is given
+  one conversion to settle and zero drift within WAKE_BAND is taken up from 3 readings, which
+  takes about 0.4 s at 10SPS
+  INPUTS:
+    Nil
+  OUTPUTS:
+    Nil
+*/
+void idleSleep() {
+  Serial.println(F("Idle, sleeping"));
+  Serial.flush();
+  halScalePower(false);
+  lcd.noDisplay();
+  halSleep();
+  halScalePower(true);
+  lcd.display();
+  readRaw();
+  long error = readAverage(3) - scaleZero;
+  if (scaleZero != -1 && labs(error) <= WAKE_BAND) {
+    zeroOffset = constrain(zeroOffset + error, -ZERO_LIMIT, ZERO_LIMIT);
+  }
+  stableCount = 0;
+  Serial.println(F("Awake"));
+  while (halButton(DISPENSE) == 0 || halButton(MODE) == 0) {
+  }
+}
+
+/*
+  Prints a message from MESSAGES[] on the LCD or serial
+  INPUTS:
+    LCD or serial
+    Message ID
+  OUTPUTS:
+    Nil
+*/
+void printMsg(Print &out, byte id) {
+  out.print((const __FlashStringHelper *)pgm_read_ptr(&MESSAGES[id]));
+}
+
+/*
+  Prints the RAM and flash budget on serial, with the static RAM of the larger buffers
+  INPUTS:
+    Nil
+  OUTPUTS:
+    Nil
+*/
+void printMemory() {
+  printMemoryLine(F("Static RAM"), halStaticRam());
+  printMemoryLine(F("Free RAM"), halFreeRam());
+  printMemoryLine(F("Stack high-water"), halStackPeak());
+  printMemoryLine(F("Never used"), halStackUnused());
+  printMemoryLine(F("Flash"), halFlashUsed());
+  printMemoryLine(F("Black box"), sizeof(bbRing) + sizeof(bbHead) + sizeof(bbCount) + sizeof(bbPumps) + sizeof(bbMagic));
+  printMemoryLine(F("Fill curve"), sizeof(curveBuffer));
+  printMemoryLine(F("SPC"), sizeof(spcCenter) + sizeof(spcCount) + sizeof(spcEwma) + sizeof(spcHigh) + sizeof(spcLow) +
+                  sizeof(spcAlarm) + sizeof(stopOffset));
+  printMemoryLine(F("Jobs"), sizeof(jobMode) + sizeof(jobCount));
+  printMemoryLine(F("Linearization"), sizeof(linRaw) + sizeof(linCorr) + sizeof(linSlope));
+  printMemoryLine(F("Scale and LCD"), sizeof(scale) + sizeof(lcd));
+}
+
+/*
+  Prints one line of the memory report
+  INPUTS:
+    Name
+    Bytes, -1 where not known
+  OUTPUTS:
+    Nil
+*/
+void printMemoryLine(const __FlashStringHelper *name, long bytes) {
+  Serial.print(name);
+  Serial.print(F(": "));
+  if (bytes == -1) {
+    Serial.println(F("n/a"));
+  }
+  else {
+    Serial.println(bytes);
+  }
+}
+
+/*
+  CRC-16/CCITT-FALSE of config snapshots, one byte at a time
+  INPUTS:
+    CRC so far, 0xFFFF to start
+    Next byte
+  OUTPUTS:
+    New CRC
+*/
+uint16_t crc16(uint16_t crc, byte value) {
+  crc ^= (uint16_t)value << 8;
+  for (byte i = 0; i < 8; i++) {
+    crc = crc & 0x8000 ? (crc << 1) ^ 0x1021 : crc << 1;
+  }
+  return crc;
+}
+
+/*
+  Sends the config snapshot on serial: "LDCF", version, length (2 bytes, low first), the bytes
+  of CONFIG_REGIONS and the CRC of version, length and bytes (low first)
+  INPUTS:
+    Nil
+  OUTPUTS:
+    Nil
+*/
+void exportConfig() {
+  uint16_t crc = 0xFFFF;
+  byte header[] = {CONFIG_VERSION, CONFIG_BYTES & 0xFF, CONFIG_BYTES >> 8};
+  Serial.print(F("LDCF"));
+  for (byte i = 0; i < sizeof(header); i++) {
+    Serial.write(header[i]);
+    crc = crc16(crc, header[i]);
+  }
+  for (byte r = 0; r < sizeof(CONFIG_REGIONS) / sizeof(CONFIG_REGIONS[0]); r++) {
+    for (int i = 0; i < CONFIG_REGIONS[r][1]; i++) {
+      byte b = EEPROM.read(CONFIG_REGIONS[r][0] + i);
+      Serial.write(b);
+      crc = crc16(crc, b);
+    }
+  }
+  Serial.write(crc & 0xFF);
+  Serial.write(crc >> 8);
+  Serial.println();
+}
+
+/*
+  Receives a config snapshot sent as by exportConfig(). Nothing is written unless the whole
+  snapshot arrived with the right version, length and CRC. CONFIG_FLAG is set while EEPROM is
+  written so an interrupted import stops fills from the next power up until a snapshot is
+  imported again. 'Config ready' is sent before the snapshot is read, and the sender must wait
+  for it, as the RX buffer is too small to hold a snapshot sent while loop() reads the scale.
+  The settings are then reloaded
+  INPUTS:
+    Nil
+  OUTPUTS:
+    Nil
+*/
+void importConfig() {
+  byte data[CONFIG_BYTES];
+  byte header[9];
+  Serial.setTimeout(CONFIG_TIMEOUT);
+  while (Serial.available() > 0) {
+    Serial.read();
+  }
+  Serial.println(F("Config ready"));
+  if (Serial.readBytes(header, 7) != 7 || memcmp_P(header, PSTR("LDCF"), 4) != 0) {
+    Serial.println(F("Config: no snapshot"));
+    return;
+  }
+  if (header[4] != CONFIG_VERSION || (header[5] | (header[6] << 8)) != CONFIG_BYTES) {
+    Serial.println(F("Config: wrong version"));
+    return;
+  }
+  if (Serial.readBytes(data, CONFIG_BYTES) != CONFIG_BYTES || Serial.readBytes(&header[7], 2) != 2) {
+    Serial.println(F("Config: snapshot incomplete"));
+    return;
+  }
+  uint16_t crc = 0xFFFF;
+  for (byte i = 4; i < 7; i++) {
+    crc = crc16(crc, header[i]);
+  }
+  for (int i = 0; i < CONFIG_BYTES; i++) {
+    crc = crc16(crc, data[i]);
+  }
+  if (crc != (uint16_t)(header[7] | (header[8] << 8))) {
+    Serial.println(F("Config: CRC error"));
+    return;
+  }
+  halStorageWrite(CONFIG_FLAG, CONFIG_PENDING);
+  halStorageCommit();
+  int n = 0;
+  for (byte r = 0; r < sizeof(CONFIG_REGIONS) / sizeof(CONFIG_REGIONS[0]); r++) {
+    for (int i = 0; i < CONFIG_REGIONS[r][1]; i++) {
+      halStorageWrite(CONFIG_REGIONS[r][0] + i, data[n++]);
+    }
+  }
+  halStorageCommit();
+  halStorageWrite(CONFIG_FLAG, 0xFF);
+  halStorageCommit();
+  loadSettings();
+  configPending = false;
+  lcd.clear();
+  updateMode(modeIndex);
+  Serial.println(F("Config imported"));
+}
+
+/*
+  Measures the noise of the scale from the differences of consecutive readings, so a steady
+  rise of the mass while the pump runs does not count as noise
+  INPUTS:
+    Number of readings
+  OUTPUTS:
+    Standard deviation of a single reading in counts
+*/
+long measureNoise(byte samples) {
+  float sum = 0;
+  float sumSquares = 0;
+  long last = readScale();
+  for (byte i = 1; i < samples; i++) {
+    halWatchdogReset();
+    long reading = readScale();
+    float d = reading - last;
+    sum += d;
+    sumSquares += d * d;
+    last = reading;
+  }
+  return noiseSigma(sum, sumSquares, samples - 1);
+}
+
+/*
+  Standard deviation of a single reading from the sums of the differences of consecutive
+  readings
+  INPUTS:
+    Sum of the differences
+    Sum of the squares of the differences
+    Number of differences, at least 2
+  OUTPUTS:
+    Standard deviation in counts
+*/
+long noiseSigma(float sum, float sumSquares, byte n) {
+  float variance = (sumSquares - sum * sum / n) / (n - 1);
+  //A difference of two readings has twice the variance of one
+  return (long)(sqrt(max(variance, 0.0f) / 2) + 0.5);
+}
+
+/*
+  Measures the noise with the pump off and then running into a container, and sets the median
+  filter window of fills from the noise with the pump running
+  INPUTS:
+    Nil
+  OUTPUTS:
+    Nil
+*/
+void runNoise() {
+  noiseOff = measureNoise(NOISE_SAMPLES);
+  halWatchdog(true);
+  setRelay(true);
+  long sigma = measureNoise(NOISE_SAMPLES);
+  setRelay(false);
+  halWatchdog(false);
+  if (machineFault == FAULT_NONE) {
+    noiseOn = sigma;
+    medianWindow = filterWindow(noiseOn);
+    EEPROMWrite(FILTER_ADDRESS, medianWindow);
+  }
+  printNoise();
+}
+
+/*
+  Smallest odd median window that brings the noise down to NOISE_TARGET. The median of n
+  readings has a standard deviation of about 1.25 sigma / sqrt(n)
+  INPUTS:
+    Standard deviation of a single reading in counts
+  OUTPUTS:
+    Median window, 1 to MEDIAN_MAX
+*/
+byte filterWindow(long sigma) {
+  sigma = constrain(sigma, 0L, 3000L);
+  for (byte n = 1; n < MEDIAN_MAX; n += 2) {
+    if (sigma * sigma * 157 <= (long)NOISE_TARGET * NOISE_TARGET * 100 * n) {
+      return n;
+    }
+  }
+  return MEDIAN_MAX;
+}
+
+/*
+  Prints the measured noise and the median filter window on serial
+  INPUTS:
+    Nil
+  OUTPUTS:
+    Nil
+*/
+void printNoise() {
+  Serial.print(F("Noise pump off: "));
+  Serial.print(noiseOff);
+  Serial.print(F("\tpump on: "));
+  Serial.print(noiseOn);
+  Serial.print(F("\tfilter window: "));
+  Serial.println(medianWindow);
+}
+
+/*
+  Times the loop it is called from, as a running average and the longest since power up
+  INPUTS:
+    Nil
+  OUTPUTS:
+    Nil
+*/
+void loopTiming() {
+  unsigned long now = micros();
+  if (loopLast != 0) {
+    unsigned long period = now - loopLast;
+    loopPeriod = loopPeriod == 0 ? period : loopPeriod - loopPeriod / 16 + period / 16;
+    if (period > loopWorst) {
+      loopWorst = period;
+    }
+  }
+  loopLast = now;
+}
+
+/*
+  Adds a reading to the live diagnostics window
+  INPUTS:
+    Scale reading
+  OUTPUTS:
+    Nil
+*/
+void diagSample(long reading) {
+  if (diagCount == 0) {
+    diagBase = reading;
+    diagMin = reading;
+    diagMax = reading;
+  }
+  float d = reading - diagBase;
+  diagSum += d;
+  diagSumSquares += d * d;
+  diagMin = min(diagMin, reading);
+  diagMax = max(diagMax, reading);
+  diagCount++;
+}
+
+/*
+  Publishes the statistics of the window and starts a new one every DIAG_WINDOW
+  INPUTS:
+    Nil
+  OUTPUTS:
+    Nil
+*/
+void diagPublish() {
+  unsigned long elapsed = millis() - diagStart;
+  if (elapsed < DIAG_WINDOW) {
+    return;
+  }
+  diagRate = diagCount * 10000L / elapsed;
+  if (diagCount > 1) {
+    float variance = (diagSumSquares - diagSum * diagSum / diagCount) / (diagCount - 1);
+    diagSd = (long)(sqrt(max(variance, 0.0f)) + 0.5);
+  }
+  diagLow = diagMin;
+  diagHigh = diagMax;
+  diagStart = millis();
+  diagCount = 0;
+  diagSum = 0;
+  diagSumSquares = 0;
+}
+
+/*
+  Leaves the time since the last loop out of the loop time and restarts the diagnostics
+  window. Called after paths that block on purpose, such as fills and sleep
+  INPUTS:
+    Nil
+  OUTPUTS:
+    Nil
+*/
+void diagSkip() {
+  loopLast = 0;
+  diagStart = millis();
+  diagCount = 0;
+  diagSum = 0;
+  diagSumSquares = 0;
+}
+
+/*
+  Prints the live diagnostics on serial. Readings are those taken by loop() in the last
+  DIAG_WINDOW
+  INPUTS:
+    Nil
+  OUTPUTS:
+    Nil
+*/
+void printDiag() {
+  Serial.print(F("Samples/s: "));
+  Serial.print(diagRate / 10.0);
+  Serial.print(F("\tsd: "));
+  Serial.print(diagSd);
+  Serial.print(F("\tmin: "));
+  Serial.print(diagLow);
+  Serial.print(F("\tmax: "));
+  Serial.println(diagHigh);
+  Serial.print(F("Zero offset: "));
+  Serial.print(zeroOffset);
+  Serial.print(F("\tloop: "));
+  Serial.print(loopPeriod);
+  Serial.print(F(" us\tworst: "));
+  Serial.print(loopWorst);
+  Serial.println(F(" us"));
+}
+
+/*
+  Runs the pump while DISPENSE is held and shows the net mass and volume since the press. On
+  release the drips are allowed to settle, then the net amount is logged and added to the total
+  volume. Must be called with the relay on and manualTare taken. Returns with the watchdog off
+  INPUTS:
+    Nil
+  OUTPUTS:
+    Settled scale reading
+*/
+long manualFill() {
+  long cpk = countsPerKg();
+  long reading = manualTare;
+  lcd.clear();
+  lcd.setCursor(0, 0);
+  printMsg(lcd, MSG_MANUAL);
+  while (halButton(DISPENSE) == 0 && machineFault == FAULT_NONE) {
+    halWatchdogReset();
+    reading = readScale();
+    lcd.setCursor(0, 1);
+    printNet(lcd, reading - manualTare, cpk);
+    lcd.print(F("    "));
+  }
+  setRelay(false);
+  long released = reading;
+  unsigned long offTime = millis();
+  unsigned long lastMove = offTime;
+  //Wait for drips to stop and the reading to be stable
+  updateStable(reading);
+  while (millis() - offTime < SETTLE_MAX && machineFault == FAULT_NONE) {
+    halWatchdogReset();
+    reading = readScale();
+    if (labs(reading - stableReading) > STABLE_BAND) {
+      lastMove = millis();
+    }
+    if (updateStable(reading) && millis() - offTime >= DRIP_TIME) {
+      break;
+    }
+  }
+  //The relay is off, and showing the result takes longer than the watchdog allows
+  halWatchdog(false);
+  if (machineFault != FAULT_NONE) {
+    manualNet = -1;
+    return reading;
+  }
+  reading = readAverage(3);
+  manualNet = reading - manualTare;
+  manualDrip = reading - released;
+  manualSettle = lastMove - offTime;
+  if (cpk > 0 && manualNet > 0) {
+    totalMl += manualNet * 1000 / cpk * 1000 / MANUAL_DENSITY;
+  }
+  lcd.setCursor(0, 1);
+  printNet(lcd, manualNet, cpk);
+  lcd.print(F("    "));
+  Serial.print(F("Manual fill: "));
+  printNet(Serial, manualNet, cpk);
+  Serial.print(F("\tnet: "));
+  Serial.print(manualNet);
+  Serial.print(F("\tdrip: "));
+  Serial.print(manualDrip);
+  Serial.print(F("\tsettle: "));
+  Serial.print(manualSettle);
+  Serial.println(F(" ms"));
+  delay(1500);
+  return reading;
+}
+
+/*
+  Prints a net reading as mass and volume at MANUAL_DENSITY, or as counts if the scale was
+  never calibrated
+  INPUTS:
+    LCD or Serial
+    Net reading in counts
+    Counts per kg from countsPerKg()
+  OUTPUTS:
+    Nil
+*/
+void printNet(Print &out, long net, long cpk) {
+  if (cpk <= 0) {
+    out.print(net);
+    printMsg(out, MSG_COUNTS);
+    return;
+  }
+  long grams = net * 1000 / cpk;
+  out.print(grams);
+  printMsg(out, MSG_GRAMS);
+  out.print(grams * 1000 / MANUAL_DENSITY);
+  printMsg(out, MSG_NET_ML);
+}
+
+/*
+  Offers to save the manual fill just measured as a mode. MODE within TEACH_WAIT starts the
+  choice of the mode, which is confirmed with DISPENSE. Choosing 'Cancel' saves nothing
+  INPUTS:
+    Nil
+  OUTPUTS:
+    Nil
+*/
+void teachPrompt() {
+  byte m = 0;
+  unsigned long start = millis();
+  lcd.setCursor(0, 0);
+  printMsg(lcd, MSG_TO_TEACH);
+  while (halButton(MODE) == 1) {
+    if (millis() - start >= TEACH_WAIT) {
+      lcd.clear();
+      updateMode(modeIndex);
+      return;
+    }
+  }
+  while (halButton(MODE) == 0) {};
+  delay(50);
+  while (halButton(DISPENSE) == 1) {
+    if (DebounceSwitch() == 1) {
+      m = (m + 1) % 4;
+    }
+    lcd.setCursor(0, 0);
+    if (m == 3) {
+      printMsg(lcd, MSG_CANCEL);
+    }
+    else {
+      printMsg(lcd, MSG_TEACH_MODE);
+      lcd.print(m + 1);
+      lcd.print(F("     "));
+    }
+    lcd.setCursor(0, 1);
+    printMsg(lcd, MSG_DISPENSE_SAVE);
+  }
+  while (halButton(DISPENSE) == 0) {};
+  delay(50);
+  lcd.clear();
+  if (m < 3 && teachMode(m)) {
+    printMsg(lcd, MSG_MODE_NUM);
+    lcd.print(m + 1);
+    printMsg(lcd, MSG_TAUGHT);
+    lcd.setCursor(0, 1);
+    lcd.print(VOLUME[m]);
+    printMsg(lcd, MSG_ML);
+    delay(2000);
+    lcd.clear();
+  }
+  updateMode(modeIndex);
+}
+
+/*
+  Saves the last manual fill as a mode. The relay turns off at the settled reading less the
+  drip, and the SPC, flow meter and timed dose of the mode start learning again
+  INPUTS:
+    Index of the mode
+  OUTPUTS:
+    False if there is no measured manual fill
+*/
+bool teachMode(byte localIndex) {
+  if (manualNet <= 0 || manualTare == -1) {
+    return false;
+  }
+  long cpk = countsPerKg();
+  val[localIndex] = manualTare + manualNet;
+  calTare[localIndex] = manualTare;
+  calTemp[localIndex] = tempValid ? temperature : -1;
+  EEPROMWrite(address[localIndex], val[localIndex]);
+  EEPROMWrite(tareAddress[localIndex], calTare[localIndex]);
+  EEPROMWrite(tempAddress[localIndex], calTemp[localIndex]);
+  spcReset(localIndex);
+  stopOffset[localIndex] = constrain(manualDrip, 0L, (long)MAX_OFFSET);
+  EEPROMWrite(SPC_ADDRESS + 8 * localIndex + 4, stopOffset[localIndex]);
+  flowCpp[localIndex] = 0;
+  doseRate[localIndex] = 0;
+  EEPROMWrite(FLOW_ADDRESS + 4 * localIndex, 0);
+  EEPROMWrite(DOSE_ADDRESS + 4 * localIndex, 0);
+  long volume = cpk > 0 ? manualNet * 1000 / cpk * 1000 / MANUAL_DENSITY : 0;
+  if (volume > 0 && volume <= 32767) {
+    VOLUME[localIndex] = volume;
+    EEPROMWrite(VOLUME_ADDRESS + 4 * localIndex, volume);
+  }
+  Serial.print(F("Mode "));
+  Serial.print(localIndex + 1);
+  Serial.print(F(" taught: "));
+  Serial.print(VOLUME[localIndex]);
+  Serial.print(F(" mL\tthreshold: "));
+  Serial.print(val[localIndex]);
+  Serial.print(F("\tstop offset: "));
+  Serial.print(stopOffset[localIndex]);
+  Serial.print(F("\tsettle: "));
+  Serial.print(manualSettle);
+  Serial.println(F(" ms"));
+  return true;
+}
 
@@ -0,0 +1,167 @@
+#!/usr/bin/env python3
+"""
+Config snapshots of the dispensing machine (CONFIG EXPORT / CONFIG IMPORT)
+
+  config_snapshot.py export <port> <file>   Save the configuration of a machine
+  config_snapshot.py import <port> <file>   Load a saved configuration into a machine
+  config_snapshot.py show <file>            Print every field of a snapshot
+  config_snapshot.py diff <file> <file>     Print the fields that differ
+
+Snapshot: "LDCF", version, length (2 bytes, low first), the EEPROM bytes of the config
+regions and the CRC-16/CCITT-FALSE of version, length and bytes (low first).
+export and import need pyserial.
+"""
+
+import struct
+import sys
+import time
+
+MAGIC = b"LDCF"
+VERSION = 3
+REGIONS = [(0, 80), (884, 108)]
+BAUD = 9600
+
+
+def crc16(data, crc=0xFFFF):
+    for b in data:
+        crc ^= b << 8
+        for _ in range(8):
+            crc = ((crc << 1) ^ 0x1021 if crc & 0x8000 else crc << 1) & 0xFFFF
+    return crc
+
+
+def fields():
+    """EEPROM address and name of every long in the config regions, as in the EEPROM map"""
+    f = []
+    for i in range(3):
+        f.append((4 * i, "threshold mode %d" % (i + 1)))
+        f.append((12 + 4 * i, "container reading mode %d" % (i + 1)))
+        f.append((24 + 4 * i, "calibration temperature mode %d" % (i + 1)))
+    f.append((36, "empty platform reading"))
+    for i in range(5):
+        f.append((40 + 8 * i, "linearization point %d reading" % (i + 1)))
+        f.append((44 + 8 * i, "linearization point %d correction" % (i + 1)))
+    for i in range(3):
+        f.append((884 + 8 * i, "SPC center line mode %d" % (i + 1)))
+        f.append((888 + 8 * i, "stop offset mode %d" % (i + 1)))
+    for a, name in ((908, "SPC EWMA limit"), (912, "SPC CUSUM k"), (916, "SPC CUSUM h"), (920, "SPC auto adjust")):
+        f.append((a, name))
+    for i in range(3):
+        f.append((924 + 4 * i, "recipe offset ingredient %d" % (i + 1)))
+        f.append((936 + 4 * i, "counts per flow pulse mode %d (Q8)" % (i + 1)))
+        f.append((948 + 4 * i, "flow rate mode %d (uL/s)" % (i + 1)))
+    for a, name in ((960, "hose delay (ms)"), (964, "valve offset (ms)"), (968, "valve auto tune"),
+                    (972, "sub-sample cut-off"), (976, "median filter window")):
+        f.append((a, name))
+    for i in range(3):
+        f.append((980 + 4 * i, "taught volume mode %d (mL)" % (i + 1)))
+    return sorted(f)
+
+
+def parse(blob):
+    """Checks a snapshot and returns its EEPROM contents as {address: byte}"""
+    start = blob.find(MAGIC)
+    if start < 0:
+        raise ValueError("no snapshot")
+    blob = blob[start + 4:]
+    version, length = struct.unpack("<BH", blob[:3])
+    if version != VERSION:
+        raise ValueError("snapshot version %d, expected %d" % (version, VERSION))
+    if length != sum(n for _, n in REGIONS) or len(blob) < 5 + length:
+        raise ValueError("snapshot length %d does not match" % length)
+    (crc,) = struct.unpack("<H", blob[3 + length:5 + length])
+    if crc16(blob[:3 + length]) != crc:
+        raise ValueError("CRC error")
+    data = blob[3:3 + length]
+    eeprom = {}
+    for base, n in REGIONS:
+        for i in range(n):
+            eeprom[base + i] = data[0]
+            data = data[1:]
+    return eeprom
+
+
+def values(eeprom):
+    return [(name, struct.unpack("<l", bytes(eeprom[a + i] for i in range(4)))[0]) for a, name in fields()]
+
+
+def load(path):
+    with open(path, "rb") as f:
+        return parse(f.read())
+
+
+def open_port(port):
+    import serial
+    s = serial.Serial(port, BAUD, timeout=3)
+    time.sleep(2)  # Opening the port resets the Nano
+    s.reset_input_buffer()
+    return s
+
+
+def export(port, path):
+    s = open_port(port)
+    s.write(b"CONFIG EXPORT\n")
+    blob = b""
+    deadline = time.time() + 5
+    while time.time() < deadline:
+        blob += s.read(s.in_waiting or 1)
+        start = blob.find(MAGIC)
+        if start >= 0 and len(blob) >= start + 9 + sum(n for _, n in REGIONS):
+            break
+    start = blob.find(MAGIC)
+    blob = blob[start:start + 9 + sum(n for _, n in REGIONS)] if start >= 0 else blob
+    parse(blob)
+    with open(path, "wb") as f:
+        f.write(blob)
+
+
+def import_(port, path):
+    with open(path, "rb") as f:
+        blob = f.read()
+    parse(blob)
+    s = open_port(port)
+    s.write(b"CONFIG IMPORT\n")
+    # The machine only reads commands between scale readings, and its RX buffer cannot hold a
+    # whole snapshot, so wait until it is ready to receive
+    deadline = time.time() + 5
+    while time.time() < deadline:
+        if s.readline().decode(errors="replace").strip() == "Config ready":
+            break
+    else:
+        sys.exit("machine not ready for the snapshot")
+    s.write(blob[blob.find(MAGIC):])
+    deadline = time.time() + 5
+    while time.time() < deadline:
+        line = s.readline().decode(errors="replace").strip()
+        if line.startswith("Config"):
+            print(line)
+            if line != "Config imported":
+                sys.exit(1)
+            return
+    sys.exit("no reply from the machine")
+
+
+def main(argv):
+    if len(argv) == 4 and argv[1] == "export":
+        export(argv[2], argv[3])
+    elif len(argv) == 4 and argv[1] == "import":
+        import_(argv[2], argv[3])
+    elif len(argv) == 3 and argv[1] == "show":
+        for name, value in values(load(argv[2])):
+            print("%-40s %d" % (name, value))
+    elif len(argv) == 4 and argv[1] == "diff":
+        a = values(load(argv[2]))
+        b = values(load(argv[3]))
+        same = True
+        for (name, va), (_, vb) in zip(a, b):
+            if va != vb:
+                print("%-40s %12d %12d" % (name, va, vb))
+                same = False
+        if same:
+            print("Snapshots are the same")
+    else:
+        sys.exit(__doc__)
+
+
+if __name__ == "__main__":
+    main(sys.argv)